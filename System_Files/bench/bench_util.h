@@ -0,0 +1,144 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Helpers shared by the benchmark harnesses: child processes driven through
+// their stdin with captured stdout, and percentile math.
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// One child process with its stdin writable and its stdout captured.
+struct Proc {
+    string name;
+    pid_t pid = -1;
+    int in_fd = -1;
+    mutex m;
+    condition_variable cv;
+    string out;
+    bool eof = false;
+    thread reader;
+    struct rusage ru;
+
+    void send(const string& line) {
+        string l = line + "\n";
+        if(write(in_fd, l.data(), l.size()) < 0) perror("write");
+    }
+
+    size_t mark() {
+        lock_guard<mutex> g(m);
+        return out.size();
+    }
+
+    // wait until needle appears at or after offset `from`
+    bool wait_for(size_t from, const string& needle, double secs) {
+        unique_lock<mutex> lk(m);
+        auto deadline = Clock::now() + chrono::milliseconds((long)(secs * 1000));
+        while(out.find(needle, from) == string::npos) {
+            if(eof || cv.wait_until(lk, deadline) == cv_status::timeout) return out.find(needle, from) != string::npos;
+        }
+        return true;
+    }
+
+    bool cmd(const string& line, const string& expect, double secs = 30) {
+        size_t off = mark();
+        send(line);
+        if(wait_for(off, expect, secs)) return true;
+        fprintf(stderr, "%s: '%s' did not answer '%s'\n", name.c_str(), line.c_str(), expect.c_str());
+        return false;
+    }
+};
+
+inline unique_ptr<Proc> spawn(const string& name, const vector<string>& args, const string& cwd) {
+    int in[2], out[2];
+    if(pipe(in) != 0 || pipe(out) != 0) { perror("pipe"); exit(1); }
+
+    unique_ptr<Proc> p(new Proc());
+    p->name = name;
+    p->pid = fork();
+    if(p->pid == 0) {
+        dup2(in[0], 0); dup2(out[1], 1); dup2(out[1], 2);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        if(chdir(cwd.c_str()) != 0) _exit(127);
+        vector<char*> argv;
+        for(auto& a : args) argv.push_back((char*)a.c_str());
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(in[0]); close(out[1]);
+    p->in_fd = in[1];
+
+    Proc *raw = p.get();
+    int rfd = out[0];
+    p->reader = thread([raw, rfd]() {
+        char buf[8192];
+        ssize_t n;
+        while((n = read(rfd, buf, sizeof(buf))) > 0) {
+            lock_guard<mutex> g(raw->m);
+            raw->out.append(buf, n);
+            raw->cv.notify_all();
+        }
+        lock_guard<mutex> g(raw->m);
+        raw->eof = true;
+        raw->cv.notify_all();
+        close(rfd);
+    });
+    return p;
+}
+
+inline double percentile(vector<double> v, double q) {
+    if(v.empty()) return 0;
+    sort(v.begin(), v.end());
+    size_t i = (size_t)(q * (v.size() - 1) + 0.5);
+    return v[min(i, v.size() - 1)];
+}
+
+
+// reap a child that was asked to quit, SIGKILL after ~1s; fills p.ru
+inline void stop_proc(Proc& p) {
+    int status;
+    pid_t r = 0;
+    for(int i = 0; i < 50 && (r = wait4(p.pid, &status, WNOHANG, &p.ru)) == 0; i++) {
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    if(r == 0) {
+        kill(p.pid, SIGKILL);
+        r = wait4(p.pid, &status, 0, &p.ru);
+    }
+    if(r < 0) memset(&p.ru, 0, sizeof(p.ru));
+    close(p.in_fd);
+    p.reader.join();
+}
+
+// scratch directory with a tracker_info.txt listing n loopback trackers
+inline string make_workdir(int ntrackers, int port_base) {
+    char tmpl[] = "/tmp/p2p_bench_XXXXXX";
+    if(!mkdtemp(tmpl)) { perror("mkdtemp"); exit(1); }
+    string work = tmpl;
+    FILE *ti = fopen((work + "/tracker_info.txt").c_str(), "w");
+    for(int i = 0; i < ntrackers; i++) fprintf(ti, "127.0.0.1:%d\n", port_base + i);
+    fclose(ti);
+    return work;
+}
+
+inline void remove_workdir(const string& work) {
+    if(system(("rm -rf " + work).c_str()) != 0) fprintf(stderr, "could not remove %s\n", work.c_str());
+}
+
+#endif
@@ -0,0 +1,116 @@
+// Piece codec benchmark: compresses and decompresses 512 KiB pieces of
+// log-like text, CSV, and random bytes the way the peer server and the
+// downloader do (random pieces are given the same 7/8 size cap the seeder
+// uses, so their row is the cost of detecting incompressible data).
+// Prints one JSON object.
+//
+//   lz_bench [--mb TOTAL_MB]
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../common/lz.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+static const size_t PIECE_SZ = 512 * 1024;
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static uint64_t next_rand() {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+static vector<uint8_t> make_log(size_t n) {
+    static const char *lvl[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    static const char *msg[] = {"piece verified", "peer connected", "dial timeout", "lease renewed",
+                                "GET_FILE_PEERS served from cache", "sync queued for tracker 1"};
+    string s;
+    char line[160];
+    for(uint64_t i = 0; s.size() < n; i++) {
+        snprintf(line, sizeof(line), "2026-10-18T%02d:%02d:%02d.%03dZ %s [worker-%d] %s idx=%llu peer=127.0.0.1:%d\n",
+                 (int)(i / 3600000 % 24), (int)(i / 60000 % 60), (int)(i / 1000 % 60), (int)(i % 1000),
+                 lvl[next_rand() % 4], (int)(next_rand() % 8), msg[next_rand() % 6],
+                 (unsigned long long)(next_rand() % 4096), 20000 + (int)(next_rand() % 15000));
+        s += line;
+    }
+    return vector<uint8_t>(s.begin(), s.begin() + n);
+}
+
+static vector<uint8_t> make_csv(size_t n) {
+    string s = "id,user,group,size,sha1,created\n";
+    char line[160];
+    for(uint64_t i = 0; s.size() < n; i++) {
+        snprintf(line, sizeof(line), "%llu,user%llu,group%llu,%llu,%016llx%08llx,2026-10-%02d\n", (unsigned long long)i,
+                 (unsigned long long)(next_rand() % 5000), (unsigned long long)(next_rand() % 50),
+                 (unsigned long long)(next_rand() % 100000000), (unsigned long long)next_rand(),
+                 (unsigned long long)(next_rand() & 0xffffffff), 1 + (int)(i % 28));
+        s += line;
+    }
+    return vector<uint8_t>(s.begin(), s.begin() + n);
+}
+
+static vector<uint8_t> make_random(size_t n) {
+    vector<uint8_t> v(n);
+    for(auto& b : v) b = (uint8_t)next_rand();
+    return v;
+}
+
+static double secs(Clock::time_point t0) {
+    return chrono::duration<double>(Clock::now() - t0).count();
+}
+
+static string run(const char *name, const vector<uint8_t>& data) {
+    size_t npieces = data.size() / PIECE_SZ;
+    vector<uint8_t> comp(npieces * lz_bound(PIECE_SZ)), out(PIECE_SZ);
+    vector<size_t> csize(npieces);
+
+    auto t0 = Clock::now();
+    uint64_t wire = 0;
+    size_t sent_raw = 0;
+    for(size_t i = 0; i < npieces; i++) {
+        csize[i] = lz_compress(data.data() + i * PIECE_SZ, PIECE_SZ, comp.data() + i * lz_bound(PIECE_SZ),
+                               PIECE_SZ - PIECE_SZ / 8);
+        if(csize[i]) wire += csize[i];
+        else { wire += PIECE_SZ; sent_raw++; }
+    }
+    double ct = secs(t0);
+
+    t0 = Clock::now();
+    bool ok = true;
+    for(size_t i = 0; i < npieces; i++) {
+        if(!csize[i]) continue;
+        ok = lz_decompress(comp.data() + i * lz_bound(PIECE_SZ), csize[i], out.data(), PIECE_SZ) &&
+             memcmp(out.data(), data.data() + i * PIECE_SZ, PIECE_SZ) == 0 && ok;
+    }
+    double dt = secs(t0);
+
+    double mb = npieces * (double)PIECE_SZ / 1e6;
+    char buf[320];
+    snprintf(buf, sizeof(buf), "\"%s\":{\"pieces\":%zu,\"ratio\":%.3f,\"sent_raw\":%zu,\"compress_mb_s\":%.0f,"
+             "\"decompress_mb_s\":%.0f,\"round_trip_ok\":%s}",
+             name, npieces, (double)wire / (npieces * (double)PIECE_SZ), sent_raw, mb / ct,
+             sent_raw == npieces ? 0.0 : mb * (double)(npieces - sent_raw) / npieces / dt, ok ? "true" : "false");
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    size_t total_mb = 64;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        string a = argv[i];
+        if(a == "--mb") total_mb = strtoul(argv[i + 1], nullptr, 10);
+        else { fprintf(stderr, "Usage: lz_bench [--mb TOTAL_MB]\n"); return 1; }
+    }
+    size_t n = max<size_t>(1, total_mb * 1024 * 1024 / PIECE_SZ) * PIECE_SZ;
+
+    string log = run("log", make_log(n));
+    string csv = run("csv", make_csv(n));
+    string rnd = run("random", make_random(n));
+    printf("{\"bench\":\"piece_codec\",\"piece_bytes\":%zu,\"total_mb\":%zu,%s,%s,%s}\n", PIECE_SZ,
+           n / (1024 * 1024), log.c_str(), csv.c_str(), rnd.c_str());
+    return log.find("\"round_trip_ok\":true") != string::npos && csv.find("\"round_trip_ok\":true") != string::npos ? 0 : 2;
+}
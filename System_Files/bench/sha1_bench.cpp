@@ -0,0 +1,131 @@
+// SHA-1 and piece-path microbenchmarks. Measures sha1() throughput on
+// piece-sized and small inputs, then the full peer-server cost per piece:
+// pread from a file, hash, and send over a socketpair to a draining reader.
+// Prints one JSON object.
+//
+//   sha1_bench [--mb TOTAL_MB] [--dir DIR]
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../common/sha1.h"
+#include "../common/proto.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+static const size_t PIECE_SZ = 512 * 1024;
+
+static double secs(Clock::time_point t0) {
+    return chrono::duration<double>(Clock::now() - t0).count();
+}
+
+// hash `len`-byte inputs back to back for at least ~0.3 s; returns ns per call
+static double time_hash(const uint8_t *data, size_t len, uint64_t min_bytes) {
+    uint8_t out[20];
+    uint64_t iters = max<uint64_t>(16, min_bytes / max<size_t>(len, 1));
+    volatile uint8_t sink = 0;
+    auto t0 = Clock::now();
+    uint64_t done = 0;
+    do {
+        for(uint64_t i = 0; i < iters; i++) {
+            sha1(data, len, out);
+            sink = sink + out[0];
+        }
+        done += iters;
+    } while(secs(t0) < 0.3);
+    return secs(t0) * 1e9 / done;
+}
+
+int main(int argc, char **argv) {
+    size_t total_mb = 64;
+    string dir = "/tmp";
+    for(int i = 1; i + 1 < argc; i += 2) {
+        string a = argv[i];
+        if(a == "--mb") total_mb = strtoul(argv[i + 1], nullptr, 10);
+        else if(a == "--dir") dir = argv[i + 1];
+        else { fprintf(stderr, "Usage: sha1_bench [--mb TOTAL_MB] [--dir DIR]\n"); return 1; }
+    }
+    if(total_mb == 0) total_mb = 1;
+
+    vector<uint8_t> piece(PIECE_SZ);
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for(auto& b : piece) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; b = (uint8_t)x; }
+
+    // hash-only throughput across input sizes
+    string sizes_json;
+    for(size_t len : {(size_t)64, (size_t)1024, (size_t)16384, PIECE_SZ}) {
+        double ns = time_hash(piece.data(), len, 64ULL << 20);
+        char line[160];
+        snprintf(line, sizeof(line), "%s\"%zu\":{\"ns_per_op\":%.0f,\"MBps\":%.1f}",
+                 sizes_json.empty() ? "" : ",", len, ns, len / ns * 1e9 / 1048576.0);
+        sizes_json += line;
+    }
+
+    // piece path: a scratch file of total_mb, served piece by piece like the peer server
+    string path = dir + "/sha1_bench." + to_string(getpid());
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if(fd < 0) { perror("open"); return 1; }
+    size_t npieces = total_mb * 1048576 / PIECE_SZ;
+    for(size_t i = 0; i < npieces; i++) {
+        piece[0] = (uint8_t)i;
+        if(write(fd, piece.data(), PIECE_SZ) != (ssize_t)PIECE_SZ) { perror("write"); return 1; }
+    }
+    fsync(fd);
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) { perror("socketpair"); return 1; }
+    thread drain([&]() {
+        vector<uint8_t> rx(PIECE_SZ);
+        for(size_t i = 0; i < npieces; i++) {
+            string hdr;
+            uint32_t n;
+            if(!recv_msg(sv[1], hdr) || recv_all(sv[1], &n, 4) != 4) return;
+            if(recv_all(sv[1], rx.data(), ntohl(n)) <= 0) return;
+        }
+    });
+
+    vector<uint8_t> buf(PIECE_SZ);
+    double read_s = 0, hash_s = 0, send_s = 0;
+    auto t0 = Clock::now();
+    for(size_t i = 0; i < npieces; i++) {
+        auto t = Clock::now();
+        ssize_t r = pread(fd, buf.data(), PIECE_SZ, (off_t)(i * PIECE_SZ));
+        read_s += secs(t);
+        if(r != (ssize_t)PIECE_SZ) { perror("pread"); return 1; }
+
+        t = Clock::now();
+        char hex[41];
+        sha1_hex(buf.data(), PIECE_SZ, hex);
+        hash_s += secs(t);
+
+        t = Clock::now();
+        send_msg(sv[0], "OK");
+        uint32_t n = htonl((uint32_t)PIECE_SZ);
+        send_all(sv[0], &n, 4);
+        send_all(sv[0], buf.data(), PIECE_SZ);
+        send_s += secs(t);
+    }
+    drain.join();
+    double wall = secs(t0);
+    close(sv[0]);
+    close(sv[1]);
+    close(fd);
+    unlink(path.c_str());
+
+    double mb = npieces * (double)PIECE_SZ / 1048576.0;
+    printf("{\"bench\":\"sha1\",\"hash\":{%s},"
+           "\"piece_path\":{\"pieces\":%zu,\"MBps\":%.1f,\"us_per_piece\":%.1f,"
+           "\"read_us\":%.1f,\"hash_us\":%.1f,\"send_us\":%.1f}}\n",
+           sizes_json.c_str(), npieces, mb / wall, wall * 1e6 / npieces,
+           read_s * 1e6 / npieces, hash_s * 1e6 / npieces, send_s * 1e6 / npieces);
+    return 0;
+}
@@ -0,0 +1,183 @@
+// Tracker startup benchmark: writes a synthetic registry in the text format,
+// then times a real tracker coming up from it, from the binary snapshot it
+// saves on quit (lazy piece lists), and from the snapshot with
+// --eager-pieces. Prints one JSON object.
+//
+//   startup_bench [--bin DIR] [--users U] [--groups G] [--files F]
+//                 [--pieces P] [--port P]
+
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "bench_util.h"
+#include "../common/proto.h"
+
+using namespace std;
+
+struct Config {
+    string bin = ".";
+    int users = 100000, groups = 1000, files = 200000, pieces = 8;
+    int port = 19700;
+};
+
+struct Run {
+    double load_ms = -1, startup_ms = -1;
+    long rss_kb = 0;
+    bool verified = false;
+};
+
+static string digest_hex(int f, int i) {
+    char buf[41];
+    uint64_t x = (uint64_t)f * 0x9E3779B97F4A7C15ULL + (uint64_t)i * 0xC2B2AE3D27D4EB4FULL + 1;
+    for(int k = 0; k < 40; k += 16) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        snprintf(buf + k, 41 - k, "%016llx", (unsigned long long)x);
+    }
+    return string(buf, 40);
+}
+
+static uint64_t write_text_registry(const Config& c, const string& dir) {
+    mkdir(dir.c_str(), 0755);
+    FILE *uf = fopen((dir + "/users.txt").c_str(), "w");
+    for(int u = 0; u < c.users; u++) fprintf(uf, "u%d p%d\n", u, u);
+    fclose(uf);
+
+    // group g is owned by user g; user u is a member of group u % G
+    FILE *gf = fopen((dir + "/groups.txt").c_str(), "w");
+    for(int g = 0; g < c.groups; g++) {
+        fprintf(gf, "g%d u%d", g, g);
+        for(int u = g; u < c.users; u += c.groups) fprintf(gf, " u%d", u);
+        fputc('\n', gf);
+    }
+    fclose(gf);
+    fclose(fopen((dir + "/requests.txt").c_str(), "w"));
+
+    FILE *ff = fopen((dir + "/files.txt").c_str(), "w");
+    for(int f = 0; f < c.files; f++) {
+        int g = f % c.groups;
+        fprintf(ff, "g%d file%d %llu %d %s u%d", g, f, (unsigned long long)c.pieces * 524288, c.pieces,
+                digest_hex(f, -1).c_str(), g);
+        for(int i = 0; i < c.pieces; i++) fprintf(ff, "%c%s", i ? ',' : ' ', digest_hex(f, i).c_str());
+        for(int p = 0; p <= f % 3; p++) fprintf(ff, " 127.0.0.1:%d", 20000 + (f * 7 + p) % 30000);
+        fputc('\n', ff);
+    }
+    uint64_t bytes = (uint64_t)ftell(ff);
+    fclose(ff);
+    return bytes;
+}
+
+static long rss_kb(pid_t pid) {
+    FILE *f = fopen(("/proc/" + to_string(pid) + "/status").c_str(), "r");
+    if(!f) return 0;
+    char line[256];
+    long kb = 0;
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "VmRSS: %ld", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// GET_FILE_PEERS for a few files must return exactly the generated digests
+static bool verify(const Config& c) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(c.port);
+    sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if(connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return false; }
+
+    bool ok = true;
+    for(int f : {0, c.files / 2, c.files - 1}) {
+        int g = f % c.groups;
+        string rep, want;
+        for(int i = 0; i < c.pieces; i++) want += (i ? "," : "") + digest_hex(f, i);
+        ok = ok && send_msg(fd, "GET_FILE_PEERS g" + to_string(g) + " file" + to_string(f) + " u" + to_string(g)) &&
+             recv_msg(fd, rep) && rep.find("\n" + want + "\n") != string::npos;
+    }
+    close(fd);
+    return ok;
+}
+
+// start a tracker in work/, wait for it to listen, measure, then stop it;
+// a clean quit saves the registry snapshot, kill_after skips that
+static Run start_tracker(const Config& c, const string& work, const string& tracker, const string& source,
+                         bool quiet, bool eager, bool kill_after) {
+    Run r;
+    vector<string> args = {tracker, "tracker_info.txt", "0"};
+    if(quiet) args.push_back("-q");
+    if(eager) args.push_back("--eager-pieces");
+
+    auto t0 = Clock::now();
+    unique_ptr<Proc> p = spawn("tracker", args, work);
+    if(p->wait_for(0, "listening", 600)) {
+        r.startup_ms = chrono::duration<double>(Clock::now() - t0).count() * 1000;
+        r.rss_kb = rss_kb(p->pid);
+        r.verified = verify(c);
+        lock_guard<mutex> g(p->m);
+        size_t at = p->out.find("from " + source + " in ");
+        if(at != string::npos) r.load_ms = atof(p->out.c_str() + at + source.size() + 9);
+    }
+    if(kill_after) kill(p->pid, SIGKILL);
+    else p->send("quit");
+    stop_proc(*p);
+    if(r.load_ms < 0) fprintf(stderr, "tracker did not load from %s\n", source.c_str());
+    return r;
+}
+
+static string run_json(const char *name, const Run& r) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "\"%s\":{\"load_ms\":%.1f,\"startup_ms\":%.1f,\"rss_kb\":%ld,\"verified\":%s}",
+             name, r.load_ms, r.startup_ms, r.rss_kb, r.verified ? "true" : "false");
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    Config c;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        string a = argv[i], v = argv[i + 1];
+        if(a == "--bin") c.bin = v;
+        else if(a == "--users") c.users = atoi(v.c_str());
+        else if(a == "--groups") c.groups = atoi(v.c_str());
+        else if(a == "--files") c.files = atoi(v.c_str());
+        else if(a == "--pieces") c.pieces = atoi(v.c_str());
+        else if(a == "--port") c.port = atoi(v.c_str());
+        else {
+            fprintf(stderr, "Usage: startup_bench [--bin DIR] [--users U] [--groups G] [--files F] [--pieces P] [--port P]\n");
+            return 1;
+        }
+    }
+    if(c.groups < 1 || c.users < c.groups || c.files < 1 || c.pieces < 1) {
+        fprintf(stderr, "need users >= groups >= 1, files >= 1, pieces >= 1\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char absbin[4096];
+    if(!realpath(c.bin.c_str(), absbin)) { perror("realpath"); return 1; }
+    string tracker = string(absbin) + "/tracker/tracker";
+    string work = make_workdir(1, c.port), data = work + "/tracker_data_0";
+    uint64_t text_bytes = write_text_registry(c, data);
+
+    // per-entry logging on, as the tracker runs by default, then quiet
+    Run text_verbose = start_tracker(c, work, tracker, "text files", false, false, true);
+    Run text = start_tracker(c, work, tracker, "text files", true, false, false);
+
+    struct stat st;
+    uint64_t snap_bytes = stat((data + "/registry.snap").c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+    Run lazy = start_tracker(c, work, tracker, "snapshot", true, false, false);
+    Run eager = start_tracker(c, work, tracker, "snapshot", true, true, false);
+    remove_workdir(work);
+
+    bool ok = text.verified && lazy.verified && eager.verified && snap_bytes > 0;
+    printf("{\"bench\":\"tracker_startup\",\"users\":%d,\"groups\":%d,\"files\":%d,\"pieces\":%d,"
+           "\"text_bytes\":%llu,\"snapshot_bytes\":%llu,\"ok\":%s,%s,%s,%s,%s}\n",
+           c.users, c.groups, c.files, c.pieces, (unsigned long long)text_bytes, (unsigned long long)snap_bytes,
+           ok ? "true" : "false", run_json("text_verbose", text_verbose).c_str(), run_json("text", text).c_str(),
+           run_json("snapshot_lazy", lazy).c_str(), run_json("snapshot_eager", eager).c_str());
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,245 @@
+// Loopback swarm benchmark: starts real tracker and client processes, seeds
+// synthetic files and times leechers downloading them. Prints one JSON object.
+//
+//   swarm_bench [--bin DIR] [--trackers N] [--seeders S] [--leechers L]
+//               [--files F] [--size BYTES] [--port-base P] [--timeout SECS]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "bench_util.h"
+
+using namespace std;
+
+struct Config {
+    string bin = ".";
+    int trackers = 2, seeders = 1, leechers = 2, files = 1;
+    uint64_t size = 64ULL << 20;
+    int port_base = 19500;
+    double timeout = 300;
+};
+
+// user+system CPU seconds consumed so far by a live process
+static double proc_cpu_s(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    char *p = strrchr(buf, ')');
+    if(!p) return 0;
+    unsigned long utime = 0, stime = 0;
+    // fields after the command name: state(3) ... utime(14) stime(15)
+    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    return (utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static bool write_synthetic(const string& path, uint64_t size, uint64_t seed) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if(!f) return false;
+    vector<uint64_t> block(8192);
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for(uint64_t done = 0; done < size;) {
+        for(auto& w : block) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; w = x; }
+        size_t n = (size_t)min<uint64_t>(size - done, block.size() * 8);
+        fwrite(block.data(), 1, n, f);
+        done += n;
+    }
+    fclose(f);
+    return true;
+}
+
+static bool same_file(const string& a, const string& b) {
+    FILE *fa = fopen(a.c_str(), "rb"), *fb = fopen(b.c_str(), "rb");
+    bool same = fa && fb;
+    vector<char> ba(1 << 20), bb(1 << 20);
+    while(same) {
+        size_t na = fread(ba.data(), 1, ba.size(), fa), nb = fread(bb.data(), 1, bb.size(), fb);
+        if(na != nb || memcmp(ba.data(), bb.data(), na) != 0) same = false;
+        if(na == 0) break;
+    }
+    if(fa) fclose(fa);
+    if(fb) fclose(fb);
+    return same;
+}
+
+static bool parse_args(int argc, char **argv, Config& c) {
+    for(int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if(i + 1 >= argc) return false;
+        string v = argv[++i];
+        if(a == "--bin") c.bin = v;
+        else if(a == "--trackers") c.trackers = atoi(v.c_str());
+        else if(a == "--seeders") c.seeders = atoi(v.c_str());
+        else if(a == "--leechers") c.leechers = atoi(v.c_str());
+        else if(a == "--files") c.files = atoi(v.c_str());
+        else if(a == "--size") c.size = strtoull(v.c_str(), nullptr, 10);
+        else if(a == "--port-base") c.port_base = atoi(v.c_str());
+        else if(a == "--timeout") c.timeout = atof(v.c_str());
+        else return false;
+    }
+    return c.trackers >= 1 && c.seeders >= 1 && c.leechers >= 1 && c.files >= 1 && c.size > 0;
+}
+
+int main(int argc, char **argv) {
+    Config cfg;
+    if(!parse_args(argc, argv, cfg)) {
+        cerr << "Usage: swarm_bench [--bin DIR] [--trackers N] [--seeders S] [--leechers L] [--files F]"
+                " [--size BYTES] [--port-base P] [--timeout SECS]\n";
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    string work = make_workdir(cfg.trackers, cfg.port_base);
+    char absbin[4096];
+    if(!realpath(cfg.bin.c_str(), absbin)) { perror("realpath"); return 1; }
+    string tracker_bin = string(absbin) + "/tracker/tracker", client_bin = string(absbin) + "/client/client";
+
+    vector<unique_ptr<Proc>> trackers, seeders, leechers;
+    bool ok = true;
+
+    for(int i = 0; i < cfg.trackers; i++) {
+        trackers.push_back(spawn("tracker" + to_string(i), {tracker_bin, "tracker_info.txt", to_string(i), "-q"}, work));
+        ok = ok && trackers.back()->wait_for(0, "listening", 10);
+    }
+    string primary = "127.0.0.1:" + to_string(cfg.port_base);
+    auto start_client = [&](const string& name) {
+        unique_ptr<Proc> p = spawn(name, {client_bin, primary, "tracker_info.txt", "--data-dir", "data_" + name}, work);
+        ok = ok && p->wait_for(0, "Peer server listening", 10);
+        return p;
+    };
+    for(int i = 0; i < cfg.seeders; i++) seeders.push_back(start_client("seeder" + to_string(i)));
+    for(int i = 0; i < cfg.leechers; i++) leechers.push_back(start_client("leecher" + to_string(i)));
+
+    // accounts and one group everyone belongs to
+    Proc& owner = *seeders[0];
+    ok = ok && owner.cmd("create_user s0 p", "OK") && owner.cmd("login s0 p", "OK") && owner.cmd("create_group bench", "OK");
+    auto enroll = [&](Proc& p, const string& user) {
+        ok = ok && p.cmd("create_user " + user + " p", "OK") && p.cmd("login " + user + " p", "OK") &&
+             p.cmd("join_group bench", "OK") && owner.cmd("accept_request bench " + user, "OK");
+    };
+    for(int i = 1; i < cfg.seeders; i++) enroll(*seeders[i], "s" + to_string(i));
+    for(int i = 0; i < cfg.leechers; i++) enroll(*leechers[i], "l" + to_string(i));
+
+    // seeding phase (untimed): seeder 0 uploads, the other seeders download
+    vector<string> names;
+    for(int f = 0; f < cfg.files && ok; f++) {
+        names.push_back("f" + to_string(f) + ".bin");
+        ok = write_synthetic(work + "/" + names[f], cfg.size, f + 1) &&
+             owner.cmd("upload_file bench " + work + "/" + names[f], "OK", cfg.timeout);
+        for(int i = 1; i < cfg.seeders && ok; i++) {
+            ok = seeders[i]->cmd("download_file bench " + names[f] + " " + work + "/seed" + to_string(i) + "_" + names[f],
+                                 "[C] bench " + names[f], cfg.timeout);
+        }
+    }
+    if(ok) this_thread::sleep_for(chrono::milliseconds(300)); // let ADD_PEER land
+
+    // timed phase: every leecher fetches every file concurrently
+    vector<Proc*> all;
+    for(auto* group : {&trackers, &seeders, &leechers}) for(auto& p : *group) all.push_back(p.get());
+    vector<double> cpu0;
+    for(auto* p : all) cpu0.push_back(proc_cpu_s(p->pid));
+
+    size_t nx = (size_t)cfg.leechers * cfg.files;
+    vector<double> ttfb(nx, -1), done(nx, -1);
+    vector<size_t> scanned(cfg.leechers, 0);
+    auto t0 = Clock::now();
+    auto since_t0 = [&]() { return chrono::duration<double>(Clock::now() - t0).count(); };
+
+    for(int l = 0; l < cfg.leechers && ok; l++) {
+        scanned[l] = leechers[l]->mark();
+        for(int f = 0; f < cfg.files; f++) {
+            leechers[l]->send("download_file bench " + names[f] + " " + work + "/l" + to_string(l) + "_" + names[f] + " &");
+        }
+    }
+
+    size_t finished = 0;
+    while(ok && finished < nx && since_t0() < cfg.timeout) {
+        for(int l = 0; l < cfg.leechers; l++) {
+            Proc& p = *leechers[l];
+            p.send("show_downloads");
+            this_thread::sleep_for(chrono::milliseconds(10));
+            string chunk;
+            {
+                lock_guard<mutex> g(p.m);
+                size_t end = p.out.rfind('\n');
+                if(end == string::npos || end < scanned[l]) continue;
+                chunk = p.out.substr(scanned[l], end + 1 - scanned[l]);
+                scanned[l] = end + 1;
+            }
+            double now = since_t0();
+            for(int f = 0; f < cfg.files; f++) {
+                size_t k = (size_t)l * cfg.files + f;
+                string c_tag = "[C] bench " + names[f], d_tag = " bench " + names[f] + " - ";
+                size_t d = chunk.find(d_tag);
+                bool progressed = d != string::npos && chunk.compare(d + d_tag.size(), 2, "0/") != 0;
+                if(chunk.find(c_tag) != string::npos) {
+                    if(ttfb[k] < 0) ttfb[k] = now;
+                    if(done[k] < 0) { done[k] = now; finished++; }
+                } else if(progressed && ttfb[k] < 0) {
+                    ttfb[k] = now;
+                }
+            }
+        }
+    }
+    double wall = since_t0();
+
+    double cpu = 0;
+    for(size_t i = 0; i < all.size(); i++) cpu += proc_cpu_s(all[i]->pid) - cpu0[i];
+
+    bool verified = finished == nx;
+    for(int l = 0; l < cfg.leechers && verified; l++) {
+        for(int f = 0; f < cfg.files && verified; f++) {
+            verified = same_file(work + "/" + names[f], work + "/l" + to_string(l) + "_" + names[f]);
+        }
+    }
+
+    if(!ok || !verified) {
+        for(auto* p : all) {
+            lock_guard<mutex> g(p->m);
+            fprintf(stderr, "--- %s output (tail) ---\n%s\n", p->name.c_str(),
+                    p->out.substr(p->out.size() > 2000 ? p->out.size() - 2000 : 0).c_str());
+        }
+    }
+
+    // shut everything down and collect peak RSS per role
+    long rss_tracker = 0, rss_client = 0;
+    for(auto* p : all) p->send("quit");
+    for(auto* p : all) {
+        bool is_tracker = p->name.compare(0, 7, "tracker") == 0;
+        stop_proc(*p);
+        long &peak = is_tracker ? rss_tracker : rss_client;
+        peak = max(peak, p->ru.ru_maxrss);
+    }
+    remove_workdir(work);
+
+    vector<double> done_ok, ttfb_ok;
+    for(size_t k = 0; k < nx; k++) {
+        if(done[k] >= 0) done_ok.push_back(done[k] * 1000);
+        if(ttfb[k] >= 0) ttfb_ok.push_back(ttfb[k] * 1000);
+    }
+    double bytes = (double)cfg.size * nx;
+    double gb_moved = (double)cfg.size * finished / 1e9;
+
+    printf("{\"bench\":\"swarm\",\"trackers\":%d,\"seeders\":%d,\"leechers\":%d,\"files\":%d,\"file_bytes\":%llu,"
+           "\"ok\":%s,\"completed\":%zu,\"expected\":%zu,\"wall_s\":%.3f,\"throughput_MBps\":%.2f,"
+           "\"ttfb_ms\":{\"p50\":%.1f,\"max\":%.1f},"
+           "\"completion_ms\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+           "\"cpu_s\":%.3f,\"cpu_s_per_GB\":%.3f,\"peak_rss_kb\":{\"tracker\":%ld,\"client\":%ld}}\n",
+           cfg.trackers, cfg.seeders, cfg.leechers, cfg.files, (unsigned long long)cfg.size,
+           ok && verified ? "true" : "false", finished, nx, wall, ok ? bytes / 1048576.0 / wall : 0.0,
+           percentile(ttfb_ok, 0.5), percentile(ttfb_ok, 1.0),
+           percentile(done_ok, 0.5), percentile(done_ok, 0.9), percentile(done_ok, 0.99), percentile(done_ok, 1.0),
+           cpu, gb_moved > 0 ? cpu / gb_moved : 0.0, rss_tracker, rss_client);
+    return ok && verified ? 0 : 2;
+}
@@ -0,0 +1,283 @@
+// Tracker command-throughput load generator. Preloads a registry of users,
+// groups and files, then replays a weighted command mix over many persistent
+// connections and prints throughput and latency percentiles as JSON.
+//
+//   tracker_loadgen [--spawn N --bin DIR | --target ip:port[,ip:port...]]
+//                   [--conns C] [--duration SECS] [--users U] [--groups G]
+//                   [--files F] [--pieces P] [--port-base P]
+//                   [--mix LOGIN=30,GET_FILE_PEERS=40,UPLOAD_META=10,ADD_PEER=20]
+
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <functional>
+#include "bench_util.h"
+#include "../common/proto.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+struct Config {
+    string bin = ".";
+    int spawn = 0;
+    vector<string> targets;
+    int conns = 16, users = 1000, groups = 50, files = 2000, pieces = 4;
+    double duration = 5;
+    int port_base = 19600;
+    vector<pair<string, int>> mix = {{"LOGIN", 30}, {"GET_FILE_PEERS", 40}, {"UPLOAD_META", 10}, {"ADD_PEER", 20}};
+};
+
+static int dial(const string& ep) {
+    size_t p = ep.find(':');
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(stoi(ep.substr(p + 1)));
+    sa.sin_addr.s_addr = inet_addr(ep.substr(0, p).c_str());
+    if(connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+static bool roundtrip(int fd, const string& msg, string& rep) {
+    return send_msg(fd, msg) && recv_msg(fd, rep);
+}
+
+struct Rng {
+    uint64_t x;
+    explicit Rng(uint64_t seed) : x(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+    uint64_t next() { x ^= x << 13; x ^= x >> 7; x ^= x << 17; return x; }
+    int below(int n) { return (int)(next() % (uint64_t)n); }
+};
+
+// Registry layout: user u belongs to group u % G (group g is owned by user g),
+// file f lives in group f % G and is owned by that group's owner.
+static string user(int u) { return "u" + to_string(u); }
+static string group(int g) { return "g" + to_string(g); }
+static string fname(int f) { return "file" + to_string(f); }
+
+static string hex40(Rng& r) {
+    static const char hex[] = "0123456789abcdef";
+    string s(40, '0');
+    for(auto& c : s) c = hex[r.below(16)];
+    return s;
+}
+
+static string upload_msg(const Config& c, int f, Rng& r) {
+    int g = f % c.groups;
+    ostringstream m;
+    m << "UPLOAD_META " << group(g) << " " << fname(f) << " " << (uint64_t)c.pieces * 524288 << " " << c.pieces
+      << " " << hex40(r) << " 127.0.0.1:" << 20000 + r.below(15000) << " " << user(g);
+    for(int i = 0; i < c.pieces; i++) m << " " << hex40(r);
+    return m.str();
+}
+
+// Build one command of the given kind against the preloaded registry.
+static string make_cmd(const Config& c, const string& kind, Rng& r) {
+    int u = r.below(c.users), g = u % c.groups;
+    int per_group = max(1, (c.files - g + c.groups - 1) / c.groups);
+    int f = g + c.groups * r.below(per_group);
+    if(kind == "LOGIN") return "LOGIN " + user(u) + " p";
+    if(kind == "GET_FILE_PEERS") return "GET_FILE_PEERS " + group(g) + " " + fname(f) + " " + user(u);
+    if(kind == "LIST_FILES") return "LIST_FILES " + group(g) + " " + user(u);
+    if(kind == "LIST_GROUPS") return "LIST_GROUPS";
+    if(kind == "ADD_PEER") return "ADD_PEER " + group(g) + " " + fname(f) + " 127.0.0.1:" + to_string(20000 + r.below(15000));
+    if(kind == "UPLOAD_META") return upload_msg(c, f, r);
+    return kind;
+}
+
+// Preload over several connections in parallel; returns false on any ERR.
+static bool preload(const Config& c) {
+    atomic<bool> ok(true);
+    auto run = [&](int nthreads, int count, function<vector<string>(int, Rng&)> cmds) {
+        vector<thread> ts;
+        for(int t = 0; t < nthreads; t++) {
+            ts.push_back(thread([&, t]() {
+                int fd = dial(c.targets[0]);
+                if(fd < 0) { ok = false; return; }
+                Rng r(1000 + t);
+                string rep;
+                for(int i = t; i < count && ok; i += nthreads) {
+                    for(auto& m : cmds(i, r)) {
+                        if(!roundtrip(fd, m, rep) || rep.compare(0, 3, "ERR") == 0) {
+                            fprintf(stderr, "preload: '%s' -> '%s'\n", m.substr(0, 80).c_str(), rep.c_str());
+                            ok = false;
+                        }
+                    }
+                }
+                close(fd);
+            }));
+        }
+        for(auto& t : ts) t.join();
+    };
+
+    int n = min(8, c.conns);
+    run(n, c.users, [](int u, Rng&) { return vector<string>{"REGISTER " + user(u) + " p"}; });
+    run(n, c.groups, [](int g, Rng&) { return vector<string>{"CREATE_GROUP " + user(g) + " " + group(g)}; });
+    run(n, c.users, [&c](int u, Rng&) {
+        int g = u % c.groups;
+        if(u == g) return vector<string>();
+        return vector<string>{"JOIN_GROUP " + user(u) + " " + group(g), "ACCEPT_REQUEST " + group(g) + " " + user(u) + " " + user(g)};
+    });
+    run(n, c.files, [&c](int f, Rng& r) { return vector<string>{upload_msg(c, f, r)}; });
+    return ok;
+}
+
+// registry sizes reported by a tracker's STATS reply ("users/groups/files")
+static string registry_counts(const string& ep) {
+    int fd = dial(ep);
+    string rep, out;
+    if(fd < 0 || !roundtrip(fd, "STATS", rep)) { if(fd >= 0) close(fd); return ""; }
+    close(fd);
+    for(const char *kind : {"users", "groups", "files"}) {
+        string key = string("p2p_tracker_registry_entries{kind=\"") + kind + "\"} ";
+        size_t p = rep.find(key);
+        out += (p == string::npos ? "?" : rep.substr(p + key.size(), rep.find('\n', p) - p - key.size())) + "/";
+    }
+    return out;
+}
+
+// replicas must hold the preloaded registry before the timed replay starts
+static bool wait_replicas(const Config& c, double timeout) {
+    auto deadline = Clock::now() + chrono::milliseconds((long)(timeout * 1000));
+    string want = registry_counts(c.targets[0]);
+    for(size_t i = 1; i < c.targets.size(); i++) {
+        while(registry_counts(c.targets[i]) != want) {
+            if(Clock::now() > deadline) return false;
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+    }
+    return true;
+}
+
+struct Sample { uint8_t kind; bool err; uint32_t us; };
+
+static bool parse_args(int argc, char **argv, Config& c) {
+    for(int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if(i + 1 >= argc) return false;
+        string v = argv[++i];
+        if(a == "--bin") c.bin = v;
+        else if(a == "--spawn") c.spawn = atoi(v.c_str());
+        else if(a == "--target") {
+            stringstream ss(v);
+            string t;
+            while(getline(ss, t, ',')) if(!t.empty()) c.targets.push_back(t);
+        }
+        else if(a == "--conns") c.conns = atoi(v.c_str());
+        else if(a == "--duration") c.duration = atof(v.c_str());
+        else if(a == "--users") c.users = atoi(v.c_str());
+        else if(a == "--groups") c.groups = atoi(v.c_str());
+        else if(a == "--files") c.files = atoi(v.c_str());
+        else if(a == "--pieces") c.pieces = atoi(v.c_str());
+        else if(a == "--port-base") c.port_base = atoi(v.c_str());
+        else if(a == "--mix") {
+            c.mix.clear();
+            stringstream ss(v);
+            string t;
+            while(getline(ss, t, ',')) {
+                size_t eq = t.find('=');
+                if(eq == string::npos) return false;
+                c.mix.push_back(make_pair(t.substr(0, eq), atoi(t.c_str() + eq + 1)));
+            }
+        }
+        else return false;
+    }
+    if(c.spawn > 0 && !c.targets.empty()) return false;
+    if(c.spawn == 0 && c.targets.empty()) c.spawn = 1;
+    return c.conns > 0 && c.users > 0 && c.groups > 0 && c.groups <= c.users && c.files >= 0 && !c.mix.empty();
+}
+
+int main(int argc, char **argv) {
+    Config cfg;
+    if(!parse_args(argc, argv, cfg)) {
+        cerr << "Usage: tracker_loadgen [--spawn N --bin DIR | --target ip:port[,...]] [--conns C] [--duration S]"
+                " [--users U] [--groups G] [--files F] [--pieces P] [--port-base P] [--mix CMD=W,...]\n";
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<unique_ptr<Proc>> trackers;
+    string work;
+    if(cfg.spawn > 0) {
+        work = make_workdir(cfg.spawn, cfg.port_base);
+        char absbin[4096];
+        if(!realpath(cfg.bin.c_str(), absbin)) { perror("realpath"); return 1; }
+        for(int i = 0; i < cfg.spawn; i++) {
+            trackers.push_back(spawn("tracker" + to_string(i),
+                                     {string(absbin) + "/tracker/tracker", "tracker_info.txt", to_string(i), "-q"}, work));
+            if(!trackers.back()->wait_for(0, "listening", 10)) { cerr << "tracker " << i << " did not start\n"; return 1; }
+            cfg.targets.push_back("127.0.0.1:" + to_string(cfg.port_base + i));
+        }
+    }
+
+    auto p0 = Clock::now();
+    bool ok = preload(cfg);
+    double preload_s = chrono::duration<double>(Clock::now() - p0).count();
+    p0 = Clock::now();
+    ok = ok && wait_replicas(cfg, 120);
+    double converge_s = chrono::duration<double>(Clock::now() - p0).count();
+
+    int total_w = 0;
+    for(auto& m : cfg.mix) total_w += m.second;
+
+    // replay: connections are spread round-robin over the targets
+    vector<vector<Sample>> samples(cfg.conns);
+    vector<thread> workers;
+    atomic<bool> stop(false);
+    auto t0 = Clock::now();
+    for(int c = 0; c < cfg.conns && ok; c++) {
+        workers.push_back(thread([&, c]() {
+            int fd = dial(cfg.targets[c % cfg.targets.size()]);
+            if(fd < 0) return;
+            Rng r(7 + c);
+            string rep;
+            while(!stop) {
+                int pick = r.below(total_w), k = 0;
+                while(pick >= cfg.mix[k].second) pick -= cfg.mix[k++].second;
+                string msg = make_cmd(cfg, cfg.mix[k].first, r);
+                auto s0 = Clock::now();
+                if(!roundtrip(fd, msg, rep)) break;
+                uint64_t us = chrono::duration_cast<chrono::microseconds>(Clock::now() - s0).count();
+                Sample smp = {(uint8_t)k, rep.compare(0, 3, "ERR") == 0, (uint32_t)min<uint64_t>(us, UINT32_MAX)};
+                samples[c].push_back(smp);
+            }
+            close(fd);
+        }));
+    }
+    this_thread::sleep_for(chrono::milliseconds((long)(cfg.duration * 1000)));
+    stop = true;
+    for(auto& t : workers) t.join();
+    double wall = chrono::duration<double>(Clock::now() - t0).count();
+
+    for(auto& t : trackers) t->send("quit");
+    for(auto& t : trackers) stop_proc(*t);
+    if(!work.empty()) remove_workdir(work);
+
+    vector<vector<double>> lat(cfg.mix.size());
+    vector<uint64_t> errs(cfg.mix.size(), 0);
+    vector<double> all;
+    for(auto& v : samples) {
+        for(auto& s : v) {
+            lat[s.kind].push_back(s.us);
+            all.push_back(s.us);
+            if(s.err) errs[s.kind]++;
+        }
+    }
+
+    printf("{\"bench\":\"tracker_loadgen\",\"trackers\":%zu,\"conns\":%d,\"users\":%d,\"groups\":%d,\"files\":%d,"
+           "\"pieces\":%d,\"ok\":%s,\"preload_s\":%.3f,\"replica_converge_s\":%.3f,\"wall_s\":%.3f,\"ops\":%zu,\"ops_per_s\":%.1f,"
+           "\"latency_us\":{\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f},\"commands\":{",
+           cfg.targets.size(), cfg.conns, cfg.users, cfg.groups, cfg.files, cfg.pieces, ok ? "true" : "false",
+           preload_s, converge_s, wall, all.size(), all.size() / wall,
+           percentile(all, 0.5), percentile(all, 0.9), percentile(all, 0.99), percentile(all, 1.0));
+    for(size_t k = 0; k < cfg.mix.size(); k++) {
+        printf("%s\"%s\":{\"ops\":%zu,\"ops_per_s\":%.1f,\"errors\":%llu,\"p50_us\":%.0f,\"p90_us\":%.0f,\"p99_us\":%.0f}",
+               k ? "," : "", cfg.mix[k].first.c_str(), lat[k].size(), lat[k].size() / wall, (unsigned long long)errs[k],
+               percentile(lat[k], 0.5), percentile(lat[k], 0.9), percentile(lat[k], 0.99));
+    }
+    printf("}}\n");
+    return ok ? 0 : 2;
+}
@@ -3,82 +3,504 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <algorithm>
 #include <sstream>
 #include <memory>
 #include <cstring>
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <tuple>
+#include <csignal>
+#include <list>
+#include <unordered_map>
 #include "../common/proto.h"
 #include "../common/sha1.h"
+#include "../common/diskio.h"
+#include "../common/mpmc_queue.h"
+#include "../common/bufpool.h"
+#include "../common/dialer.h"
+#include "../common/lz.h"
+#include "../common/merkle.h"
+#include "../common/snapshot.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
 
 using namespace std;
 
 const size_t PIECE_SZ = 524288; // 512 KiB per piece
 const int MAX_SIM_PIECES = 8; // max parallel piece fetches
+const int HASH_WORKERS = 2; // verify stage threads per download
+const int PIPELINE_BUFS = MAX_SIM_PIECES * 2; // piece buffers in flight per download
+const int DIAL_RACE_WIDTH = 3; // peers dialed at once for each piece attempt
+const int MERKLE_PIECE_LEVEL = 5; // a piece is the subtree over 32 leaf blocks
+const size_t PEX_MAX_PEERS = 50; // endpoints per PEX reply, and most a file's peer list grows to by PEX
+const uint64_t PEX_INTERVAL_MS = 30000; // a download asks any one peer at most this often
+const int PEX_SERVE_PER_SEC = 20; // PEX replies the peer server hands out per second
+static_assert(PIECE_SZ == MERKLE_BLOCK << MERKLE_PIECE_LEVEL, "pieces must be aligned Merkle subtrees");
 
 static vector<string> trackers;
 static string connected_tracker, current_user;
 static map<string, string> uploaded_files;
+// file sha -> local path; GETPIECE names content, so one copy serves every
+// group it is shared in. Guarded by uploaded_mtx like uploaded_files.
+static map<string, string> shared_content;
+// root -> tree of every Merkle-mode file we serve, for GETPIECE ... m proofs
+static map<string, shared_ptr<const MerkleTree>> merkle_trees;
+// Everything we share, "group name" -> path and content, so a restart resumes
+// seeding without re-uploads. Persisted with peer_port to shares.snap under
+// client_data_dir. Guarded by uploaded_mtx.
+struct Share { string path, sha; bool merkle; };
+static map<string, Share> share_table;
 static mutex uploaded_mtx, downloads_mtx;
 static int peer_port = 0;
+static int listen_port = 0; // --port; otherwise the port from the last run
+static int dial_timeout_ms = 1500; // --dial-timeout
+static bool compress_pieces = true; // --no-compress turns it off in both directions
+static bool merkle_uploads = false; // --merkle: register uploads by tree root instead of a piece list
+static string client_data_dir = "client_data"; // --data-dir: hash cache and share table
+static bool own_data_dir = false; // holds <data-dir>/lock; nothing there is read or written otherwise
+static int reverify_secs = 0; // --reverify SECS: re-check shared files whose mtime moved; 0 = off
+// --data-stdout: the original stdout, kept for one "download_file ... -" stream;
+// console output goes to stderr instead. -1 when not available (or used up).
+static atomic<int> stdout_data_fd(-1);
+static const chrono::steady_clock::time_point client_start = chrono::steady_clock::now();
+
+// piece buffers for the peer server, download pipelines and the hasher
+static BufferPool piece_pool(PIECE_SZ, 64);
+
+// Throughput of one pipeline stage and occupancy of the queue feeding it.
+struct StageStats {
+    atomic<uint64_t> items, bytes, busy_ns;
+    atomic<uint64_t> depth_sum, depth_samples, depth_max;
+    StageStats() : items(0), bytes(0), busy_ns(0), depth_sum(0), depth_samples(0), depth_max(0) {}
+
+    void record(uint64_t nbytes, uint64_t ns, uint64_t count = 1) { items += count; bytes += nbytes; busy_ns += ns; }
+    void sample_depth(size_t d) {
+        depth_sum += d; depth_samples++;
+        uint64_t m = depth_max.load();
+        while(d > m && !depth_max.compare_exchange_weak(m, d));
+    }
+};
+
+struct PieceJob {
+    int idx, attempt; // attempts so far; a piece is dropped after 2 per peer
+    struct PeerStats *peer; // who served buf
+    int buf;
+    uint32_t len;
+};
+
+// receive -> verify -> write stages of one download, linked by bounded
+// lock-free queues and a fixed set of reusable piece buffers
+struct Pipeline {
+    MpmcQueue<PieceJob> work, verify, write;
+    MpmcQueue<int> free_bufs;
+    vector<uint8_t*> bufs; // borrowed from piece_pool for the job's lifetime
+    atomic<int> outstanding; // pieces neither written nor given up on
+    StageStats recv, hash, disk;
+    chrono::steady_clock::time_point started;
+    atomic<uint64_t> wall_ns; // set once the job finishes
+
+    Pipeline(size_t npieces, int nbufs) : work(npieces), verify(nbufs), write(nbufs), free_bufs(nbufs),
+                                          outstanding((int)npieces), started(chrono::steady_clock::now()), wall_ns(0) {
+        for(int i = 0; i < nbufs; i++) {
+            bufs.push_back(piece_pool.acquire());
+            free_bufs.push(i);
+        }
+    }
+    ~Pipeline() { release_bufs(); }
+
+    void release_bufs() {
+        for(auto b : bufs) piece_pool.release(b);
+        bufs.clear();
+    }
+};
+
+static uint64_t mono_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Byte counter with a moving-average rate. Transfer threads only do an
+// atomic add; the average (5 s time constant) is folded in by whoever reads
+// it, so readers never block writers.
+struct RateMeter {
+    atomic<uint64_t> total, sample_ns, sample_bytes;
+    atomic<double> ewma; // bytes per second
+    atomic<bool> primed;
+    RateMeter() : total(0), sample_ns(mono_ns()), sample_bytes(0), ewma(0.0), primed(false) {}
+
+    void add(uint64_t n) { total.fetch_add(n, memory_order_relaxed); }
+    double rate() {
+        uint64_t now = mono_ns(), last = sample_ns.load();
+        if(now - last >= 250000000ULL && sample_ns.compare_exchange_strong(last, now)) {
+            uint64_t b = total.load(), prev = sample_bytes.exchange(b);
+            double dt = (now - last) / 1e9;
+            double alpha = primed.exchange(true) ? 1.0 - exp(-dt / 5.0) : 1.0; // first sample seeds the average
+            double avg = ewma.load();
+            ewma = avg + alpha * ((b - prev) / dt - avg);
+        }
+        return ewma.load();
+    }
+};
+
+static uint64_t elapsed_ns(chrono::steady_clock::time_point t0) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+}
+
+static uint64_t now_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Reachability of one peer address, shared by every download that lists it.
+// Each failure (dial, transfer or bad hash) doubles how long the peer is
+// tried only as a last resort, up to 30 s; any success clears it.
+struct PeerHealth {
+    atomic<int> fail_streak;
+    atomic<uint64_t> avoid_until_ms;
+    PeerHealth() : fail_streak(0), avoid_until_ms(0) {}
+
+    void ok() { fail_streak = 0; avoid_until_ms = 0; }
+    void failed() {
+        int streak = min(++fail_streak, 7);
+        avoid_until_ms = now_ms() + min<uint64_t>(30000, 250ULL << streak);
+    }
+    bool avoided(uint64_t now) const { return avoid_until_ms.load() > now; }
+};
+
+static PeerHealth& health_of(const string& addr) {
+    static mutex m;
+    static map<string, unique_ptr<PeerHealth>> all; // never shrinks: one entry per address ever seen
+    lock_guard<mutex> g(m);
+    auto& h = all[addr];
+    if(!h) h.reset(new PeerHealth());
+    return *h;
+}
+
+struct PeerStats {
+    string addr;
+    PeerHealth& health;
+    RateMeter bytes;
+    atomic<uint64_t> pieces, failures, hash_failures;
+    atomic<uint64_t> last_pex_ms; // when this job last asked the peer for PEX
+    explicit PeerStats(const string& a)
+        : addr(a), health(health_of(a)), pieces(0), failures(0), hash_failures(0), last_pex_ms(0) {}
+};
+
+// One file of a download job. A job is a single file or a whole directory
+// tree; piece indices run across all of its files in order, so one set of
+// pipeline stages schedules every piece of the tree.
+struct JobFile {
+    string name, sha, dest;
+    uint64_t size;
+    vector<string> hashes;
+    vector<int> peers; // indices into DownloadStatus::peers that serve this file; under peers_m
+    int first;         // job-wide index of this file's piece 0
+    int left;          // pieces not yet on disk; write stage only
+    // opened on its first piece and closed once complete, so a tree of
+    // thousands of files never holds more than a few descriptors
+    shared_ptr<PieceFile> out;
+    // Merkle-mode files have no piece list: each piece arrives with a proof
+    // against root, and the verified leaves are kept to serve it onward
+    bool merkle = false;
+    Digest root;
+    vector<Digest> leaves;
+
+    // dest holds file bytes [from, to): the whole file, unless this is a
+    // download_range job, which fetches only the pieces covering the range
+    uint64_t from = 0, to = 0;
+
+    int npieces() const { return merkle ? (int)((size + PIECE_SZ - 1) / PIECE_SZ) : (int)hashes.size(); }
+    int lo() const { return (int)(from / PIECE_SZ); }
+    int span() const { return (int)((to + PIECE_SZ - 1) / PIECE_SZ) - lo(); } // pieces in the job
+    int piece_of(int job_idx) const { return job_idx - first + lo(); }
+    bool partial() const { return from > 0 || to < size; }
+
+    // the part of file piece p (len bytes) inside [from, to): skip bytes in,
+    // n bytes long, landing at dest offset at
+    void clip(int p, uint32_t len, uint32_t& skip, uint32_t& n, uint64_t& at) const {
+        uint64_t start = (uint64_t)p * PIECE_SZ, b = max(start, from), e = min(start + len, to);
+        skip = (uint32_t)(b - start);
+        n = e > b ? (uint32_t)(e - b) : 0;
+        at = b - from;
+    }
+};
 
 struct DownloadStatus {
-    string group, filename, dest;
+    string group, filename, dest; // filename is the directory for a tree
+    bool tree;
+    vector<JobFile> files;
+    vector<int> piece_file; // job-wide piece index -> files[]
     int npieces;
+    uint64_t size;
     vector<int> have;
-    atomic<int> remaining;
+    atomic<int> remaining, have_count;
     atomic<bool> completed, running;
     mutex m;
-    DownloadStatus() : npieces(0), remaining(0), completed(false), running(false) {}
+    shared_ptr<Pipeline> pipe;
+    RateMeter written; // verified bytes on disk
+    atomic<uint64_t> retries, hash_failures;
+    uint64_t reused_bytes; // taken from a local copy of the previous version; set before the job starts
+    // every peer of the job; peer exchange appends to it (and to the files'
+    // peer lists) mid-job, so both are read and grown under peers_m
+    vector<unique_ptr<PeerStats>> peers;
+    mutex peers_m;
+    atomic<uint64_t> pex_added; // peers learned by PEX
+    // Streaming jobs write pieces to stream_fd strictly in order. Only pieces
+    // in [next_emit, next_emit + window) are fetched, so at most window
+    // out-of-order pieces sit in buffers waiting for the gap to fill.
+    int stream_fd;
+    string stream_path; // a FIFO to stream to; opened by the job, since open() waits for a reader
+    int window;
+    atomic<int> next_emit;
+    DownloadStatus() : tree(false), npieces(0), size(0), remaining(0), have_count(0), completed(false), running(false),
+                       retries(0), hash_failures(0), reused_bytes(0), pex_added(0), stream_fd(-1), window(0), next_emit(0) {}
 };
 
 static map<string, shared_ptr<DownloadStatus>> downloads;
 
-bool send_to_endpoint(const string& addr, const string& msg, string& reply) {
-    size_t p = addr.find(':');
-    if(p == string::npos) return false;
-
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd < 0) return false;
+// connect to ip:port within dial_timeout_ms, then a 10 s send timeout; -1 on failure
+static int connect_endpoint(const string& addr) {
+    int fd = dial(addr, dial_timeout_ms);
+    if(fd < 0) return -1;
 
     struct timeval timeout;
     timeout.tv_sec = 10;
     timeout.tv_usec = 0;
     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
 
-    sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(stoi(addr.substr(p+1)));
-    sa.sin_addr.s_addr = inet_addr(addr.substr(0,p).c_str());
+// One long-lived connection per tracker, shared by every thread. Requests
+// go out as "#<id> CMD ..." and the tracker echoes the tag, so any number
+// can be in flight; a reader thread hands each reply to its waiter.
+class TrackerSession {
+public:
+    static const int REPLY_TIMEOUT_MS = 30000;
+
+    // false if the tracker could not be reached or did not answer in time;
+    // *stale is set when an existing connection turned out to be dead, and
+    // *unanswered when the request went out but no reply came back (timeout
+    // or the connection dropping), so the tracker may have acted on it
+    bool request(const string& ep, const string& msg, string& reply, bool *stale = nullptr,
+                 bool *unanswered = nullptr, int timeout_ms = REPLY_TIMEOUT_MS) {
+        bool reused;
+        shared_ptr<Conn> c = get(ep, reused);
+        if(!c) return false;
+        int r = request_on(c, msg, reply, timeout_ms);
+        if(stale) *stale = reused && (r == DEAD || r == LOST);
+        if(unanswered) *unanswered = r == LOST || r == TIMEOUT;
+        return r == OK;
+    }
 
-    if(connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) {
-        close(fd);
-        return false;
+private:
+    enum { OK, DEAD, LOST, TIMEOUT }; // LOST: sent, then the connection died
+
+    struct Conn {
+        int fd = -1;
+        mutex send_m, m;
+        condition_variable cv;
+        bool dead = false;
+        uint64_t next_id = 1;
+        set<uint64_t> waiting;
+        map<uint64_t, string> replies;
+        ~Conn() { if(fd >= 0) close(fd); }
+    };
+
+    mutex m_;
+    map<string, shared_ptr<Conn>> conns_;
+
+    int request_on(const shared_ptr<Conn>& c, const string& msg, string& reply, int timeout_ms) {
+        uint64_t id;
+        {
+            lock_guard<mutex> g(c->m);
+            if(c->dead) return DEAD;
+            id = c->next_id++;
+            c->waiting.insert(id);
+        }
+        bool sent;
+        {
+            lock_guard<mutex> g(c->send_m);
+            sent = send_msg(c->fd, "#" + to_string(id) + " " + msg);
+        }
+        if(!sent) kill(c);
+
+        unique_lock<mutex> lk(c->m);
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+        bool got = c->cv.wait_until(lk, deadline, [&]() { return c->dead || c->replies.count(id); });
+        c->waiting.erase(id);
+        auto it = c->replies.find(id);
+        if(it != c->replies.end()) {
+            reply = move(it->second);
+            c->replies.erase(it);
+            return OK;
+        }
+        lk.unlock();
+        // a timeout leaves the stream with an unmatched reply in it; start over
+        if(!got) kill(c);
+        return got ? (sent ? LOST : DEAD) : TIMEOUT;
     }
 
-    bool ok = send_msg(fd, msg) && recv_msg(fd, reply);
-    close(fd);
-    return ok;
+    static void kill(const shared_ptr<Conn>& c) {
+        lock_guard<mutex> g(c->m);
+        if(!c->dead) shutdown(c->fd, SHUT_RDWR); // wakes the reader, which marks it dead
+    }
+
+    static bool alive(const shared_ptr<Conn>& c) {
+        lock_guard<mutex> g(c->m);
+        return !c->dead;
+    }
+
+    shared_ptr<Conn> get(const string& ep, bool& reused) {
+        reused = false;
+        {
+            lock_guard<mutex> g(m_);
+            auto it = conns_.find(ep);
+            if(it != conns_.end() && alive(it->second)) {
+                reused = true;
+                return it->second;
+            }
+        }
+
+        // dial without holding m_ so a slow tracker does not hold up the others
+        int fd = connect_endpoint(ep);
+        if(fd < 0) return nullptr;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        shared_ptr<Conn> c = make_shared<Conn>();
+        c->fd = fd;
+
+        lock_guard<mutex> g(m_);
+        auto& slot = conns_[ep];
+        if(slot && alive(slot)) return slot; // lost a race with another dialer; c closes itself
+        slot = c;
+        thread(reader, c).detach();
+        return c;
+    }
+
+    static void reader(shared_ptr<Conn> c) {
+        string msg;
+        while(recv_msg(c->fd, msg, MAX_BULK_MSG_BYTES)) { // GET_DIR replies can be large
+            size_t sp = msg.find(' ');
+            if(msg.empty() || msg[0] != '#' || sp == string::npos) continue;
+            uint64_t id = strtoull(msg.c_str() + 1, nullptr, 10);
+            lock_guard<mutex> g(c->m);
+            if(c->waiting.count(id)) {
+                c->replies[id] = msg.substr(sp + 1);
+                c->cv.notify_all();
+            }
+        }
+        lock_guard<mutex> g(c->m);
+        c->dead = true;
+        c->cv.notify_all();
+    }
+};
+
+// never destroyed: probers and readers may still be running at exit()
+static TrackerSession& tracker_session = *new TrackerSession;
+
+// Liveness and round-trip time of each tracker, kept current by one prober
+// thread per tracker pinging over its session every PROBE_INTERVAL_MS.
+struct TrackerHealth {
+    string ep;
+    atomic<bool> up;
+    atomic<double> rtt_ms; // EWMA; 0 until the first successful probe
+    atomic<uint64_t> probes, failures;
+    explicit TrackerHealth(const string& e) : ep(e), up(true), rtt_ms(0), probes(0), failures(0) {}
+};
+
+static const int PROBE_INTERVAL_MS = 1000, PROBE_TIMEOUT_MS = 3000;
+// reads stay on the tracker that took the last write for this long (replication is async)
+static const int READ_AFTER_WRITE_MS = 1000;
+static vector<unique_ptr<TrackerHealth>> tracker_health; // one per entry of trackers, fixed after startup
+static mutex tracker_mtx; // guards connected_tracker
+static atomic<uint64_t> last_write_ms(0);
+
+static void probe_tracker(TrackerHealth *h) {
+    while(true) {
+        auto t0 = chrono::steady_clock::now();
+        string rep;
+        bool ok = tracker_session.request(h->ep, "PING", rep, nullptr, nullptr, PROBE_TIMEOUT_MS) && rep == "PONG";
+        h->probes++;
+        if(ok) {
+            double ms = elapsed_ns(t0) / 1e6, prev = h->rtt_ms.load();
+            h->rtt_ms = prev == 0 ? ms : prev + 0.2 * (ms - prev);
+        } else {
+            h->failures++;
+        }
+        h->up = ok;
+        this_thread::sleep_for(chrono::milliseconds(PROBE_INTERVAL_MS));
+    }
 }
 
-bool tracker_roundtrip(const string& msg, string& reply) {
-    if(send_to_endpoint(connected_tracker, msg, reply)) return true;
+static void start_tracker_probes() {
+    for(auto& t : trackers) tracker_health.push_back(unique_ptr<TrackerHealth>(new TrackerHealth(t)));
+    for(auto& h : tracker_health) thread(probe_tracker, h.get()).detach();
+}
 
-    for(auto& t : trackers) {
-        if(t != connected_tracker && send_to_endpoint(t, msg, reply)) {
-            connected_tracker = t;
-            cout << "Switched to tracker: " << t << endl;
-            return true;
+static bool is_read_cmd(const string& msg) {
+    string cmd = msg.substr(0, msg.find(' '));
+    return cmd == "LIST_GROUPS" || cmd == "LIST_FILES" || cmd == "GET_FILE_PEERS" || cmd == "GET_DIR" || cmd == "GET_VERSION";
+}
+
+// Trackers to try, best first. Writes stick to connected_tracker while it is
+// up, otherwise the first live tracker in tracker_info order. Reads go to
+// the live tracker with the lowest probe RTT. Trackers the prober saw down
+// are kept only as a last resort, so failover never waits on a dead one.
+static vector<TrackerHealth*> route(bool read, const string& preferred) {
+    vector<TrackerHealth*> order;
+    for(auto& h : tracker_health) order.push_back(h.get());
+    bool by_rtt = read && now_ms() - last_write_ms.load() >= (uint64_t)READ_AFTER_WRITE_MS;
+    auto rank = [&](TrackerHealth *h) {
+        double rtt = h->rtt_ms.load();
+        return make_tuple(!h->up.load(), by_rtt ? (rtt > 0 ? rtt : 1e9) : 0.0, by_rtt ? 0 : h->ep != preferred);
+    };
+    stable_sort(order.begin(), order.end(), [&](TrackerHealth *a, TrackerHealth *b) { return rank(a) < rank(b); });
+    return order;
+}
+
+bool tracker_roundtrip(const string& msg, string& reply) {
+    string preferred;
+    {
+        lock_guard<mutex> g(tracker_mtx);
+        preferred = connected_tracker;
+    }
+    bool read = is_read_cmd(msg);
+
+    for(TrackerHealth *h : route(read, preferred)) {
+        // a session that died while idle gets one fresh connection before moving on
+        bool stale = false, unanswered = false;
+        bool ok = tracker_session.request(h->ep, msg, reply, &stale, &unanswered) ||
+                  (stale && (read || !unanswered) && tracker_session.request(h->ep, msg, reply, nullptr, &unanswered));
+        if(!ok) {
+            h->up = false; // until the prober sees it answer again
+            if(unanswered && !read) {
+                // the tracker may have applied and replicated it; resending could apply it twice
+                cout << "No reply from tracker " << h->ep << "; not retrying, the command may have been applied" << endl;
+                return false;
+            }
+            continue;
+        }
+        if(!read) {
+            last_write_ms = now_ms();
+            if(h->ep != preferred) {
+                lock_guard<mutex> g(tracker_mtx);
+                connected_tracker = h->ep;
+                cout << "Switched to tracker: " << h->ep << endl;
+            }
         }
+        return true;
     }
     return false;
 }
@@ -95,8 +517,7 @@ void compute_piece_and_file_sha1(const string& path, vector<string>& piece_hex,
     piece_hex.clear();
     piece_hex.reserve(np);
 
-    unique_ptr<uint8_t[]> buf(new uint8_t[PIECE_SZ]);
-    if(!buf) { fclose(f); return; }
+    PooledBuf buf(piece_pool);
 
     for(size_t i = 0; i < np; i++) {
         size_t to_read = (i == np - 1) ? size - i * PIECE_SZ : PIECE_SZ;
@@ -117,6 +538,412 @@ void compute_piece_and_file_sha1(const string& path, vector<string>& piece_hex,
     fclose(f);
 }
 
+// Merkle-mode hashing: one leaf per 16 KiB block, built into tree; the
+// root stands in for the file sha. False (size 0) if unreadable or empty.
+bool compute_merkle(const string& path, MerkleTree& tree, string& root_hex, uint64_t& size) {
+    size = 0;
+    FILE *f = fopen(path.c_str(), "rb");
+    if(!f) return false;
+
+    fseek(f, 0, SEEK_END);
+    uint64_t fsz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    vector<Digest> leaves;
+    leaves.reserve((fsz + MERKLE_BLOCK - 1) / MERKLE_BLOCK);
+    PooledBuf buf(piece_pool);
+    for(uint64_t off = 0; off < fsz; off += PIECE_SZ) {
+        size_t want = (size_t)min<uint64_t>(PIECE_SZ, fsz - off);
+        if(fread(buf.get(), 1, want, f) != want) {
+            fclose(f);
+            return false;
+        }
+        for(size_t b = 0; b < want; b += MERKLE_BLOCK) leaves.push_back(digest_of(buf.get() + b, min(MERKLE_BLOCK, want - b)));
+    }
+    fclose(f);
+    if(leaves.empty()) return false;
+
+    tree.build(move(leaves));
+    root_hex = digest_hex(tree.root());
+    size = fsz;
+    return true;
+}
+
+// Digests of files this client has hashed, so re-sharing an unchanged file
+// after a restart or logout costs a stat instead of a full read. Entries are
+// keyed by (device, inode) and only trusted while size and mtime still match.
+// Persisted as a snapshot (common/snapshot.h) under client_data_dir.
+class HashCache {
+public:
+    struct Entry {
+        string path;
+        uint64_t size = 0, mtime_ns = 0;
+        bool merkle = false;
+        string digests; // raw 20-byte piece digests, or leaf digests in Merkle mode
+    };
+
+    static uint64_t mtime_of(const struct stat& st) {
+        return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+    }
+
+    // entries whose path no longer names the same inode are dropped
+    void load(const string& file) {
+        lock_guard<mutex> g(m_);
+        file_ = file;
+        SnapReader r;
+        if(!r.open(file)) return;
+        uint32_t n, merkle, nd;
+        bool ok = r.u32(n);
+        for(uint32_t i = 0; ok && i < n; i++) {
+            uint64_t dev, ino;
+            Entry e;
+            const uint8_t *d = nullptr;
+            ok = r.u64(dev) && r.u64(ino) && r.str(e.path) && r.u64(e.size) && r.u64(e.mtime_ns) && r.u32(merkle) &&
+                 r.u32(nd) && r.raw(d, 20 * (size_t)nd);
+            if(!ok) break;
+            struct stat st;
+            if(stat(e.path.c_str(), &st) != 0 || (uint64_t)st.st_dev != dev || (uint64_t)st.st_ino != ino) continue;
+            e.merkle = merkle != 0;
+            e.digests.assign((const char*)d, 20 * (size_t)nd);
+            entries_[make_pair(dev, ino)] = move(e);
+        }
+        if(!ok) entries_.clear();
+    }
+
+    bool save() {
+        lock_guard<mutex> g(m_);
+        if(file_.empty()) return false;
+        SnapWriter w;
+        w.u32((uint32_t)entries_.size());
+        for(auto& kv : entries_) {
+            const Entry& e = kv.second;
+            w.u64(kv.first.first);
+            w.u64(kv.first.second);
+            w.str(e.path);
+            w.u64(e.size);
+            w.u64(e.mtime_ns);
+            w.u32(e.merkle);
+            w.u32((uint32_t)(e.digests.size() / 20));
+            w.raw(e.digests.data(), e.digests.size());
+        }
+        return w.commit(file_);
+    }
+
+    // the cheap invalidation check: same inode, size and mtime as when hashed
+    bool get(const struct stat& st, bool merkle, Entry& out) {
+        lock_guard<mutex> g(m_);
+        auto it = entries_.find(make_pair((uint64_t)st.st_dev, (uint64_t)st.st_ino));
+        if(it == entries_.end() || it->second.size != (uint64_t)st.st_size || it->second.mtime_ns != mtime_of(st) ||
+           it->second.merkle != merkle) {
+            misses++;
+            return false;
+        }
+        hits++;
+        out = it->second;
+        return true;
+    }
+
+    void put(const struct stat& st, Entry e) {
+        lock_guard<mutex> g(m_);
+        e.size = (uint64_t)st.st_size;
+        e.mtime_ns = mtime_of(st);
+        entries_[make_pair((uint64_t)st.st_dev, (uint64_t)st.st_ino)] = move(e);
+    }
+
+    size_t size() {
+        lock_guard<mutex> g(m_);
+        return entries_.size();
+    }
+
+    atomic<uint64_t> hits{0}, misses{0};
+
+private:
+    mutex m_;
+    string file_;
+    map<pair<uint64_t, uint64_t>, Entry> entries_;
+};
+
+static HashCache hash_cache;
+
+// Record digests for path as it is on disk now (after a download, say).
+// Callers save() the cache once they are done.
+static void remember_hashes(const string& path, bool merkle, string digests) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) return;
+    HashCache::Entry e;
+    e.path = path;
+    e.merkle = merkle;
+    e.digests = move(digests);
+    hash_cache.put(st, move(e));
+}
+
+static string raw_digests(const vector<string>& hex) {
+    string out(20 * hex.size(), '\0');
+    for(size_t i = 0; i < hex.size(); i++) hex_to_raw(hex[i], (uint8_t*)&out[20 * i], 20);
+    return out;
+}
+
+static string raw_leaves(const vector<Digest>& leaves) {
+    return string((const char*)leaves.data(), 20 * leaves.size());
+}
+
+static string raw_leaves(const MerkleTree& t) {
+    string out;
+    out.reserve(20 * t.leaves());
+    for(size_t i = 0; i < t.leaves(); i++) out.append((const char*)t.leaf(i).data(), 20);
+    return out;
+}
+
+// Digests for sharing path: piece list and file sha, or in Merkle mode the
+// tree and its root. Served from the hash cache when the file is unchanged,
+// otherwise read, hashed and cached. size is 0 if unreadable or empty.
+static void hash_for_share(const string& path, bool merkle, vector<string>& pieces, string& sha, uint64_t& size,
+                           shared_ptr<MerkleTree>& tree) {
+    size = 0;
+    pieces.clear();
+    struct stat before, after;
+    if(stat(path.c_str(), &before) != 0 || !S_ISREG(before.st_mode)) return;
+
+    HashCache::Entry e;
+    if(hash_cache.get(before, merkle, e) && !e.digests.empty()) {
+        size_t n = e.digests.size() / 20;
+        if(merkle) {
+            vector<Digest> leaves(n);
+            memcpy(leaves.data(), e.digests.data(), e.digests.size());
+            tree = make_shared<MerkleTree>();
+            tree->build(move(leaves));
+            sha = digest_hex(tree->root());
+        } else {
+            string concat;
+            for(size_t i = 0; i < n; i++) pieces.push_back(raw_to_hex((const uint8_t*)e.digests.data() + 20 * i, 20));
+            for(auto& h : pieces) concat += h;
+            char fh[41];
+            sha1_hex((const uint8_t*)concat.data(), concat.size(), fh);
+            sha = fh;
+        }
+        size = e.size;
+        return;
+    }
+
+    if(merkle) {
+        tree = make_shared<MerkleTree>();
+        compute_merkle(path, *tree, sha, size);
+    } else {
+        compute_piece_and_file_sha1(path, pieces, sha, size);
+        if(pieces.empty()) size = 0;
+    }
+    // only cache what was read from an unchanged file
+    if(size && stat(path.c_str(), &after) == 0 && after.st_size == before.st_size &&
+       HashCache::mtime_of(after) == HashCache::mtime_of(before)) {
+        remember_hashes(path, merkle, merkle ? raw_leaves(*tree) : raw_digests(pieces));
+    }
+}
+
+static mutex shares_file_mtx; // orders writers of shares.snap
+
+static void save_shares() {
+    if(!own_data_dir) return;
+    lock_guard<mutex> g_f(shares_file_mtx);
+    SnapWriter w;
+    {
+        lock_guard<mutex> g(uploaded_mtx);
+        w.u32((uint32_t)peer_port);
+        w.u32((uint32_t)share_table.size());
+        for(auto& kv : share_table) {
+            w.str(kv.first);
+            w.str(kv.second.path);
+            w.str(kv.second.sha);
+            w.u32(kv.second.merkle);
+        }
+    }
+    if(!w.commit(client_data_dir + "/shares.snap")) cerr << "could not save the share table" << endl;
+}
+
+// share table of the last run; returns its port, 0 if there is none
+// One client per data directory. A second client reading the share table
+// would announce itself for the first one's files, and the two would
+// overwrite each other's saves. The descriptor stays open, and the lock
+// held, until exit.
+static bool lock_data_dir() {
+    int fd = open((client_data_dir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) return false;
+    if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+static int load_shares() {
+    SnapReader r;
+    uint32_t port, n, merkle;
+    if(!r.open(client_data_dir + "/shares.snap") || !r.u32(port) || !r.u32(n)) return 0;
+    map<string, Share> table;
+    for(uint32_t i = 0; i < n; i++) {
+        string key;
+        Share s;
+        if(!r.str(key) || !r.str(s.path) || !r.str(s.sha) || !r.u32(merkle)) return 0;
+        s.merkle = merkle != 0;
+        table[key] = move(s);
+    }
+    lock_guard<mutex> g(uploaded_mtx);
+    share_table.swap(table);
+    return (int)port;
+}
+
+// Pieces the peer server has already compressed, keyed by "<sha> <idx>". A
+// blob is exactly what follows "OKZ" on the wire; an empty one marks a piece
+// that did not compress, so it is sent raw without trying again. LRU,
+// bounded by blob bytes.
+class PieceZCache {
+public:
+    explicit PieceZCache(size_t cap) : cap_(cap), bytes_(0) {}
+
+    shared_ptr<const string> get(const string& key) {
+        lock_guard<mutex> g(m_);
+        auto it = idx_.find(key);
+        if(it == idx_.end()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    void put(const string& key, shared_ptr<const string> blob) {
+        lock_guard<mutex> g(m_);
+        if(idx_.count(key)) return;
+        lru_.emplace_front(key, blob);
+        idx_[key] = lru_.begin();
+        bytes_ += blob->size() + key.size();
+        while(bytes_ > cap_ && lru_.size() > 1) {
+            auto& old = lru_.back();
+            bytes_ -= old.second->size() + old.first.size();
+            idx_.erase(old.first);
+            lru_.pop_back();
+        }
+    }
+
+private:
+    mutex m_;
+    list<pair<string, shared_ptr<const string>>> lru_;
+    unordered_map<string, list<pair<string, shared_ptr<const string>>>::iterator> idx_;
+    size_t cap_, bytes_;
+};
+
+static PieceZCache zcache(64 << 20);
+// pieces this peer sent (compressed / raw because they did not shrink) and
+// received (compressed, with their wire and decoded sizes, or raw)
+static atomic<uint64_t> z_served(0), z_served_raw(0), z_cache_hits(0);
+static atomic<uint64_t> z_recv(0), z_recv_raw(0), z_wire_bytes(0), z_plain_bytes(0);
+
+// Peer exchange. Peers known to hold each file, by content sha, learned from
+// tracker replies, PEX replies and holders announcing themselves. A peer
+// answers "PEX <sha> [<self>]" with the newest of these, so downloads can
+// find peers that joined after their tracker query without asking again.
+// Capped per file; the oldest entry makes room.
+class PexTable {
+public:
+    void learn(const string& sha, const string& addr) {
+        lock_guard<mutex> g(m_);
+        auto& known = by_sha_[sha];
+        known[addr] = now_ms();
+        if(known.size() <= PEX_MAX_PEERS) return;
+        auto oldest = known.begin();
+        for(auto it = known.begin(); it != known.end(); ++it) {
+            if(it->second < oldest->second) oldest = it;
+        }
+        known.erase(oldest);
+    }
+
+    // newest first, without except
+    vector<string> sample(const string& sha, const string& except) {
+        vector<pair<uint64_t, string>> v;
+        {
+            lock_guard<mutex> g(m_);
+            auto it = by_sha_.find(sha);
+            if(it == by_sha_.end()) return {};
+            for(auto& kv : it->second) {
+                if(kv.first != except) v.push_back(make_pair(kv.second, kv.first));
+            }
+        }
+        sort(v.rbegin(), v.rend());
+        vector<string> out;
+        for(size_t i = 0; i < v.size() && i < PEX_MAX_PEERS; i++) out.push_back(v[i].second);
+        return out;
+    }
+
+    // token bucket over PEX replies served, so gossip cannot crowd out pieces
+    bool admit() {
+        lock_guard<mutex> g(m_);
+        uint64_t now = now_ms();
+        tokens_ = min<double>(PEX_SERVE_PER_SEC, tokens_ + (now - last_ms_) * PEX_SERVE_PER_SEC / 1000.0);
+        last_ms_ = now;
+        if(tokens_ < 1) return false;
+        tokens_ -= 1;
+        return true;
+    }
+
+private:
+    mutex m_;
+    map<string, map<string, uint64_t>> by_sha_;
+    double tokens_ = PEX_SERVE_PER_SEC;
+    uint64_t last_ms_ = 0;
+};
+
+static PexTable pex;
+// PEX requests sent, replies served and refused by the rate limit, and
+// peers added to downloads from replies
+static atomic<uint64_t> pex_sent(0), pex_served(0), pex_refused(0), pex_learned(0);
+
+// "PEX <sha> [<addr>]": reply with the peers we know for sha. A requester
+// that already holds the file names its own listening address, which is
+// only believed if it is on the host the request came from.
+static void serve_pex(int c, const vector<string>& parts) {
+    if(!pex.admit()) {
+        pex_refused++;
+        send_msg(c, "ERR busy");
+        return;
+    }
+    pex_served++;
+    string from;
+    if(parts.size() == 3) {
+        sockaddr_in sa;
+        socklen_t len = sizeof(sa);
+        char ip[INET_ADDRSTRLEN];
+        if(getpeername(c, (sockaddr*)&sa, &len) == 0 && inet_ntop(AF_INET, &sa.sin_addr, ip, sizeof(ip)) &&
+           parts[2].compare(0, strlen(ip) + 1, string(ip) + ":") == 0) {
+            from = parts[2];
+            pex.learn(parts[1], from);
+        }
+    }
+    string out;
+    for(auto& a : pex.sample(parts[1], from)) out += a + "\n";
+    send_msg(c, out);
+}
+
+// "OKZ" payload for one piece: u32 raw length, u32 compressed length, data.
+// Empty when compressing would not save at least an eighth.
+static shared_ptr<const string> compress_piece(const uint8_t *data, size_t len) {
+    string blob(8 + lz_bound(len), '\0');
+    size_t cn = lz_compress(data, len, (uint8_t*)&blob[8], len - len / 8);
+    if(!cn) return make_shared<const string>();
+    uint32_t hdr[2] = {htonl((uint32_t)len), htonl((uint32_t)cn)};
+    memcpy(&blob[0], hdr, 8);
+    blob.resize(8 + cn);
+    return make_shared<const string>(move(blob));
+}
+
+// Stop serving path by content once no shared name points at it any more.
+// Caller holds uploaded_mtx.
+static void unshare_content(const string& path) {
+    for(auto& kv : uploaded_files) {
+        if(kv.second == path) return;
+    }
+    for(auto it = shared_content.begin(); it != shared_content.end();) {
+        if(it->second != path) { ++it; continue; }
+        merkle_trees.erase(it->first);
+        it = shared_content.erase(it);
+    }
+}
+
 void peer_server_thread(int port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     int opt = 1;
@@ -143,22 +970,49 @@ void peer_server_thread(int port) {
                 return;
             }
 
+            // GETPIECE <sha> <idx> [z] [m]; z means the requester can take
+            // OKZ, m that it wants the piece's Merkle proof ahead of the data
             auto parts = split_ws(rq);
-            if(parts.size() != 3 || parts[0] != "GETPIECE") {
+            if((parts.size() == 2 || parts.size() == 3) && parts[0] == "PEX") {
+                serve_pex(c, parts);
+                close(c);
+                return;
+            }
+            if(parts.size() < 3 || parts.size() > 5 || parts[0] != "GETPIECE") {
                 send_msg(c, "ERR");
                 close(c);
                 return;
             }
 
-            string filename = parts[1];
+            // content sha; a bare filename still works for older clients
+            string key = parts[1];
             int idx = stoi(parts[2]);
+            bool want_z = false, want_m = false;
+            for(size_t i = 3; i < parts.size(); i++) {
+                if(parts[i] == "z") want_z = compress_pieces;
+                else if(parts[i] == "m") want_m = true;
+            }
             string filepath;
+            bool by_content = false;
+            shared_ptr<const MerkleTree> tree;
 
             {
                 lock_guard<mutex> g(uploaded_mtx);
-                auto it = uploaded_files.find(filename);
-                if(it != uploaded_files.end()) {
-                    filepath = it->second;
+                const string *found = nullptr;
+                auto it = shared_content.find(key);
+                by_content = it != shared_content.end();
+                if(by_content) {
+                    found = &it->second;
+                } else {
+                    auto nt = uploaded_files.find(key);
+                    if(nt != uploaded_files.end()) found = &nt->second;
+                }
+                if(want_m) {
+                    auto t = merkle_trees.find(key);
+                    if(t != merkle_trees.end()) tree = t->second;
+                }
+                if(found && (!want_m || tree)) {
+                    filepath = *found;
                 } else {
                     send_msg(c, "ERR");
                     close(c);
@@ -166,6 +1020,35 @@ void peer_server_thread(int port) {
                 }
             }
 
+            if(tree) {
+                // the piece's leaf digests, then the uncles from its subtree up
+                size_t first = (size_t)idx << MERKLE_PIECE_LEVEL;
+                if(idx < 0 || first >= tree->leaves()) {
+                    send_msg(c, "ERR");
+                    close(c);
+                    return;
+                }
+                size_t last = min(tree->leaves(), first + ((size_t)1 << MERKLE_PIECE_LEVEL));
+                vector<Digest> uncles = tree->proof(MERKLE_PIECE_LEVEL, idx);
+                string proof;
+                proof.reserve(20 * (last - first + uncles.size()));
+                for(size_t i = first; i < last; i++) proof.append((const char*)tree->leaf(i).data(), 20);
+                for(auto& u : uncles) proof.append((const char*)u.data(), 20);
+                send_msg(c, proof);
+            }
+
+            // only content-addressed pieces are cached; a name can be reused
+            string zkey = key + " " + to_string(idx);
+            shared_ptr<const string> zblob = want_z && by_content ? zcache.get(zkey) : nullptr;
+            if(zblob && !zblob->empty()) {
+                z_cache_hits++;
+                z_served++;
+                send_msg(c, "OKZ");
+                send_all(c, zblob->data(), zblob->size());
+                close(c);
+                return;
+            }
+
             FILE *f = fopen(filepath.c_str(), "rb");
             if(!f) {
                 send_msg(c, "ERR");
@@ -188,28 +1071,41 @@ void peer_server_thread(int port) {
             size_t to_read = (idx == (int)np - 1) ? fsz - off : PIECE_SZ;
 
             fseek(f, off, SEEK_SET);
-            vector<uint8_t> data(to_read);
-            size_t r = fread(data.data(), 1, to_read, f);
+            PooledBuf data(piece_pool);
+            size_t r = fread(data.get(), 1, to_read, f);
             fclose(f);
 
+            if(want_z && !zblob && r == to_read) {
+                zblob = compress_piece(data.get(), to_read);
+                if(by_content) zcache.put(zkey, zblob);
+            }
             if(r != to_read) {
                 send_msg(c, "ERR");
+            } else if(zblob && !zblob->empty()) {
+                z_served++;
+                send_msg(c, "OKZ");
+                send_all(c, zblob->data(), zblob->size());
             } else {
+                if(want_z) z_served_raw++;
                 send_msg(c, "OK");
                 uint32_t n = htonl((uint32_t)to_read);
                 send_all(c, &n, 4);
-                send_all(c, data.data(), to_read);
+                send_all(c, data.get(), to_read);
             }
             close(c);
         }).detach();
     }
 }
 
-void start_peer_server() {
+// preferred (the last run's port, or --port) is tried first, so the
+// addresses the tracker and other peers hold for us stay valid
+void start_peer_server(int preferred) {
     srand(time(NULL) + getpid());
     int port = 20000 + rand() % 15000;
 
-    for(int tries = 0; tries < 40; tries++, port++) {
+    for(int tries = 0; tries <= 40; tries++) {
+        int p = tries == 0 ? preferred : port++;
+        if(p <= 0) continue;
         int test_fd = socket(AF_INET, SOCK_STREAM, 0);
         if(test_fd < 0) continue;
 
@@ -219,13 +1115,13 @@ void start_peer_server() {
         sockaddr_in sa;
         memset(&sa, 0, sizeof(sa));
         sa.sin_family = AF_INET;
-        sa.sin_port = htons(port);
+        sa.sin_port = htons(p);
         sa.sin_addr.s_addr = INADDR_ANY;
 
         if(bind(test_fd, (sockaddr*)&sa, sizeof(sa)) == 0) {
             close(test_fd);
-            thread(peer_server_thread, port).detach();
-            peer_port = port;
+            thread(peer_server_thread, p).detach();
+            peer_port = p;
             return;
         }
         close(test_fd);
@@ -233,150 +1129,764 @@ void start_peer_server() {
     peer_port = port;
 }
 
-bool fetch_one_piece(const string& peer, const string& fname, int idx, const string& dest, const string& expected_sha) {
-    size_t p = peer.find(':');
-    if(p == string::npos) return false;
+static string my_peer_addr() {
+    return "127.0.0.1:" + to_string(peer_port);
+}
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd < 0) return false;
+// Stop serving content sha from path after it changed on disk; the share
+// table forgets it too, so the next run does not resume it.
+static void drop_changed(const string& sha, const string& path) {
+    bool served;
+    size_t forgot = 0;
+    {
+        lock_guard<mutex> g(uploaded_mtx);
+        auto it = shared_content.find(sha);
+        served = it != shared_content.end() && it->second == path;
+        if(served) {
+            shared_content.erase(it);
+            merkle_trees.erase(sha);
+        }
+        for(auto t = share_table.begin(); t != share_table.end();) {
+            if(t->second.sha == sha && t->second.path == path) { t = share_table.erase(t); forgot++; }
+            else ++t;
+        }
+    }
+    if(forgot) save_shares();
+    if(served || forgot) cout << path << " changed on disk; no longer served until uploaded again" << endl;
+}
+
+// --reverify: every reverify_secs, shared files whose size or mtime moved
+// since they were hashed are re-hashed in the background. A file that was
+// only touched is re-stamped and keeps being served; one whose content
+// changed stops being served by content until it is uploaded again, so
+// peers are not handed pieces that fail their hash.
+void reverify_thread() {
+    while(true) {
+        this_thread::sleep_for(chrono::seconds(reverify_secs));
+        map<string, string> shared;
+        set<string> merkle;
+        {
+            lock_guard<mutex> g(uploaded_mtx);
+            shared = shared_content;
+            for(auto& kv : merkle_trees) merkle.insert(kv.first);
+        }
+        bool dirty = false;
+        for(auto& kv : shared) {
+            struct stat st;
+            HashCache::Entry e;
+            bool is_merkle = merkle.count(kv.first) > 0;
+            if(stat(kv.second.c_str(), &st) == 0 && hash_cache.get(st, is_merkle, e)) continue;
+
+            vector<string> pieces;
+            string sha;
+            uint64_t size;
+            shared_ptr<MerkleTree> tree;
+            hash_for_share(kv.second, is_merkle, pieces, sha, size, tree);
+            if(size && sha == kv.first) {
+                dirty = true;
+                continue;
+            }
+            drop_changed(kv.first, kv.second);
+        }
+        if(dirty) hash_cache.save();
+    }
+}
+
+// list this peer on every file in table with one ANNOUNCE; returns the reply
+static string announce_shares(const map<string, Share>& table) {
+    string msg = "ANNOUNCE " + my_peer_addr(), rep;
+    for(auto& kv : table) msg += " " + kv.first + " " + kv.second.sha;
+    if(!tracker_roundtrip(msg, rep)) rep = "All trackers unreachable";
+    return rep;
+}
+
+// Resume the shares persisted by the last run: serve them at once, re-list
+// us on the tracker with one ANNOUNCE, then check them in the background.
+// Files whose size and mtime match the hash cache cost a stat; others are
+// re-hashed, and any whose content changed or that are gone are dropped.
+// Until then a stale piece only fails the downloader's hash check; Merkle
+// shares are served once their tree is rebuilt from the cache.
+static void resume_shares() {
+    map<string, Share> table;
+    {
+        lock_guard<mutex> g(uploaded_mtx);
+        table = share_table;
+        for(auto& kv : table) {
+            uploaded_files[kv.first.substr(kv.first.find(' ') + 1)] = kv.second.path;
+            if(!kv.second.merkle) shared_content[kv.second.sha] = kv.second.path;
+        }
+    }
+    if(table.empty()) return;
+    save_shares(); // the port may have changed
+
+    thread([table]() {
+        cout << "resuming " << table.size() << " shares: " << announce_shares(table) << endl;
+
+        size_t kept = 0;
+        for(auto& kv : table) {
+            const Share& s = kv.second;
+            vector<string> pieces;
+            string sha;
+            uint64_t size;
+            shared_ptr<MerkleTree> tree;
+            hash_for_share(s.path, s.merkle, pieces, sha, size, tree);
+            if(!size || sha != s.sha) {
+                drop_changed(s.sha, s.path);
+                continue;
+            }
+            kept++;
+            if(!s.merkle) continue;
+            lock_guard<mutex> g(uploaded_mtx);
+            if(share_table.count(kv.first)) {
+                shared_content[s.sha] = s.path;
+                merkle_trees[s.sha] = tree;
+            }
+        }
+        hash_cache.save();
+        cout << kept << "/" << table.size() << " resumed shares verified" << endl;
+    }).detach();
+}
+
+// Keeps this peer's tracker lease alive while it shares anything. The tracker
+// answers "OK <ttl>" and stops listing us if a few renewals in a row are missed.
+void heartbeat_thread() {
+    int interval_s = 1; // until the first reply tells us the TTL
+    while(true) {
+        this_thread::sleep_for(chrono::seconds(interval_s));
+        {
+            lock_guard<mutex> g(uploaded_mtx);
+            if(uploaded_files.empty()) continue;
+        }
+        string rep;
+        if(!tracker_roundtrip("HEARTBEAT " + my_peer_addr(), rep)) continue;
+        bool evicted = rep.compare(0, 8, "EVICTED ") == 0;
+        if(!evicted && rep.compare(0, 3, "OK ") != 0) continue;
+        int ttl = atoi(rep.c_str() + (evicted ? 8 : 3));
+        if(ttl > 0) interval_s = max(1, ttl / 3);
+        if(evicted) {
+            // the tracker dropped us while we were unreachable; list our shares again
+            map<string, Share> table;
+            {
+                lock_guard<mutex> g(uploaded_mtx);
+                table = share_table;
+            }
+            if(!table.empty()) cout << "re-announcing " << table.size() << " shares: " << announce_shares(table) << endl;
+        }
+    }
+}
 
+// Merkle-mode check of one piece, done while it is received: the proof is
+// checked against the file root first, then every block as it lands, so a
+// bad peer is dropped at its first bad block instead of after the piece.
+struct PieceCheck {
+    const JobFile *file;
+    Digest *leaves; // out: the piece's verified leaf digests
+    bool corrupt;   // out: the peer sent a bad proof or block
+};
+
+// network stage: pull one piece from a peer into buf; only Merkle-mode
+// pieces (mk set) are verified here, the rest by the verify stage
+bool recv_piece(int fd, const string& fsha, int idx, uint8_t *buf, uint32_t& n, PieceCheck *mk = nullptr) {
     struct timeval timeout;
     timeout.tv_sec = 15;
     timeout.tv_usec = 0;
     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-    sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(stoi(peer.substr(p+1)));
-    sa.sin_addr.s_addr = inet_addr(peer.substr(0,p).c_str());
-
-    if(connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) {
+    string req = "GETPIECE " + fsha + " " + to_string(idx) + (compress_pieces ? " z" : "") + (mk ? " m" : "");
+    if(!send_msg(fd, req)) {
         close(fd);
         return false;
     }
 
-    string req = "GETPIECE " + fname + " " + to_string(idx);
-    if(!send_msg(fd, req)) {
-        close(fd);
-        return false;
+    vector<Digest> leaves;
+    size_t plen = 0;
+    if(mk) {
+        const JobFile& f = *mk->file;
+        plen = (size_t)min<uint64_t>(PIECE_SZ, f.size - (uint64_t)idx * PIECE_SZ);
+        size_t k = (plen + MERKLE_BLOCK - 1) / MERKLE_BLOCK;
+        string proof;
+        if(!recv_msg(fd, proof) || proof.size() % 20 || proof.size() < 20 * k) {
+            close(fd);
+            return false;
+        }
+        leaves.resize(proof.size() / 20);
+        memcpy(leaves.data(), proof.data(), proof.size());
+        if(!merkle_verify(merkle_fold(leaves.data(), k), MERKLE_PIECE_LEVEL, idx, leaves.data() + k, leaves.size() - k,
+                          f.leaves.size(), f.root)) {
+            mk->corrupt = true;
+            close(fd);
+            return false;
+        }
+        leaves.resize(k);
     }
+    auto block_ok = [&](uint32_t off, uint32_t len) {
+        if(!mk || digest_of(buf + off, len) == leaves[off / MERKLE_BLOCK]) return true;
+        mk->corrupt = true;
+        return false;
+    };
+    auto accept = [&]() {
+        if(mk) copy(leaves.begin(), leaves.end(), mk->leaves);
+        return true;
+    };
 
     string rep;
-    if(!recv_msg(fd, rep) || rep != "OK") {
+    if(!recv_msg(fd, rep) || (rep != "OK" && rep != "OKZ")) {
         close(fd);
         return false;
     }
 
-    uint32_t n;
+    if(rep == "OKZ") {
+        // decoded straight into buf; the verify stage still hashes the result
+        uint32_t hdr[2];
+        if(recv_all(fd, hdr, 8) != 8) {
+            close(fd);
+            return false;
+        }
+        n = ntohl(hdr[0]);
+        uint32_t cn = ntohl(hdr[1]);
+        if(n > PIECE_SZ || cn >= n || (mk && n != plen)) {
+            close(fd);
+            return false;
+        }
+        thread_local vector<uint8_t> zbuf(lz_bound(PIECE_SZ));
+        bool ok = recv_all(fd, zbuf.data(), cn) == (ssize_t)cn && lz_decompress(zbuf.data(), cn, buf, n);
+        close(fd);
+        for(uint32_t off = 0; ok && mk && off < n; off += MERKLE_BLOCK) ok = block_ok(off, min<uint32_t>(MERKLE_BLOCK, n - off));
+        if(ok) {
+            z_recv++;
+            z_wire_bytes += cn;
+            z_plain_bytes += n;
+        }
+        return ok && accept();
+    }
+
     if(recv_all(fd, &n, 4) != 4) {
         close(fd);
         return false;
     }
     n = ntohl(n);
-    if(n > PIECE_SZ) {
+    if(n > PIECE_SZ || (mk && n != plen)) {
         close(fd);
         return false;
     }
 
-    vector<char> buf(n);
-    if(recv_all(fd, buf.data(), n) != (ssize_t)n) {
-        close(fd);
-        return false;
+    bool ok;
+    if(!mk) {
+        ok = recv_all(fd, buf, n) == (ssize_t)n;
+    } else {
+        ok = true;
+        for(uint32_t off = 0; ok && off < n; off += MERKLE_BLOCK) {
+            uint32_t len = min<uint32_t>(MERKLE_BLOCK, n - off);
+            ok = recv_all(fd, buf + off, len) == (ssize_t)len && block_ok(off, len);
+        }
     }
+    close(fd);
+    if(ok) z_recv_raw++;
+    return ok && accept();
+}
 
-    char computed[41];
-    sha1_hex((const uint8_t*)buf.data(), n, computed);
-    if(string(computed) != expected_sha) {
-        close(fd);
-        return false;
+// Up to DIAL_RACE_WIDTH peers to race for one attempt at a piece: healthy
+// peers before ones in backoff, fewer recent failures first, and otherwise
+// rotated by piece so the load spreads over the whole swarm.
+static vector<PeerStats*> pick_peers(DownloadStatus& ds, const JobFile& f, int rotation) {
+    lock_guard<mutex> g(ds.peers_m);
+    int n = (int)f.peers.size();
+    uint64_t now = now_ms();
+    vector<int> order(f.peers);
+    auto key = [&](int i) {
+        PeerHealth& h = ds.peers[i]->health;
+        return make_tuple(h.avoided(now), h.fail_streak.load(), (i - rotation % n + n) % n);
+    };
+    sort(order.begin(), order.end(), [&](int a, int b) { return key(a) < key(b); });
+    order.resize(min(n, DIAL_RACE_WIDTH));
+    vector<PeerStats*> out;
+    for(int i : order) out.push_back(ds.peers[i].get());
+    return out;
+}
+
+static int max_attempts(DownloadStatus& ds, const JobFile& f) {
+    lock_guard<mutex> g(ds.peers_m);
+    return (int)f.peers.size() * 2;
+}
+
+// Add addrs to f's peers, and to the job's, as far as PEX_MAX_PEERS allows;
+// returns how many were new to f.
+static size_t add_file_peers(DownloadStatus& ds, JobFile& f, const vector<string>& addrs) {
+    string self = my_peer_addr();
+    size_t added = 0;
+    lock_guard<mutex> g(ds.peers_m);
+    for(auto& a : addrs) {
+        if(f.peers.size() >= PEX_MAX_PEERS) break;
+        if(a == self || a.find(':') == string::npos) continue;
+        int idx = 0;
+        while(idx < (int)ds.peers.size() && ds.peers[idx]->addr != a) idx++;
+        if(idx == (int)ds.peers.size()) ds.peers.push_back(unique_ptr<PeerStats>(new PeerStats(a)));
+        if(find(f.peers.begin(), f.peers.end(), idx) != f.peers.end()) continue;
+        f.peers.push_back(idx);
+        added++;
     }
+    return added;
+}
 
-    int out_fd = open(dest.c_str(), O_WRONLY);
-    if(out_fd < 0) {
-        close(fd);
-        return false;
+// After a piece from ps, and at most every PEX_INTERVAL_MS per peer, ask it
+// which other peers hold f. New ones join the job at once, so the swarm a
+// download draws on keeps growing (and replaces peers that died) without
+// another tracker query.
+static void exchange_peers(DownloadStatus& ds, JobFile& f, PeerStats& ps) {
+    uint64_t now = now_ms(), last = ps.last_pex_ms;
+    if(now < last + PEX_INTERVAL_MS || !ps.last_pex_ms.compare_exchange_strong(last, now)) return;
+    {
+        lock_guard<mutex> g(ds.peers_m);
+        if(f.peers.size() >= PEX_MAX_PEERS) return;
     }
+    int fd = connect_endpoint(ps.addr);
+    if(fd < 0) return;
+    struct timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    string rep;
+    pex_sent++;
+    bool ok = send_msg(fd, "PEX " + f.sha) && recv_msg(fd, rep) && rep.compare(0, 3, "ERR") != 0;
+    close(fd);
+    if(!ok) return;
 
-    off_t off = (off_t)idx * (off_t)PIECE_SZ;
-    if(lseek(out_fd, off, SEEK_SET) < 0) {
-        close(out_fd);
-        close(fd);
-        return false;
+    vector<string> addrs = split_ws(rep);
+    for(auto& a : addrs) pex.learn(f.sha, a);
+    size_t added = add_file_peers(ds, f, addrs);
+    ds.pex_added += added;
+    pex_learned += added;
+}
+
+
+// Give up on a piece: it stays missing and the job ends incomplete. A
+// stream cannot skip past it, so a streaming job ends right there.
+static void drop_piece(Pipeline& pl, const DownloadStatus& ds) {
+    if(ds.stream_fd >= 0) pl.outstanding = 0;
+    else pl.outstanding--;
+}
+
+static void recv_stage(Pipeline& pl, DownloadStatus& ds) {
+    Backoff idle;
+    while(pl.outstanding > 0) {
+        PieceJob job;
+        if(!pl.work.pop(job)) { idle.pause(); continue; }
+        if(ds.stream_fd >= 0 && job.idx >= ds.next_emit + ds.window) {
+            // ahead of the window: requeue, so a retried earlier piece behind it gets a turn
+            pl.work.push(job);
+            idle.pause();
+            continue;
+        }
+        pl.recv.sample_depth(pl.work.size());
+        while(!pl.free_bufs.pop(job.buf)) {
+            if(pl.outstanding <= 0) return; // a stream was cut short
+            idle.pause();
+        }
+        idle.reset();
+
+        JobFile& f = ds.files[ds.piece_file[job.idx]];
+        int attempts = max_attempts(ds, f);
+        auto t0 = chrono::steady_clock::now();
+        bool got = false;
+        for(; job.attempt < attempts && !got; job.attempt++) {
+            vector<PeerStats*> cands = pick_peers(ds, f, job.idx + job.attempt);
+            vector<string> addrs;
+            for(auto c : cands) addrs.push_back(c->addr);
+
+            int winner;
+            vector<DialResult> res;
+            int fd = dial_race(addrs, dial_timeout_ms, &winner, &res);
+            for(size_t i = 0; i < cands.size(); i++) {
+                if(res[i] != DIAL_FAILED && res[i] != DIAL_TIMEOUT) continue;
+                cands[i]->failures++;
+                cands[i]->health.failed();
+            }
+            if(fd < 0) {
+                ds.retries++;
+                continue;
+            }
+
+            PeerStats& ps = *cands[winner];
+            int pidx = f.piece_of(job.idx);
+            PieceCheck check = {&f, f.merkle ? &f.leaves[(size_t)pidx << MERKLE_PIECE_LEVEL] : nullptr, false};
+            got = recv_piece(fd, f.sha, pidx, pl.bufs[job.buf], job.len, f.merkle ? &check : nullptr);
+            if(check.corrupt) {
+                ps.hash_failures++;
+                ds.hash_failures++;
+            }
+            if(got) {
+                ps.health.ok();
+                ps.bytes.add(job.len);
+                ps.pieces++;
+                job.peer = &ps;
+                exchange_peers(ds, f, ps);
+            } else {
+                ps.health.failed();
+                ps.failures++;
+                ds.retries++;
+            }
+        }
+        if(!got) {
+            pl.free_bufs.push(job.buf);
+            drop_piece(pl, ds);
+            continue;
+        }
+        job.attempt--;
+        pl.recv.record(job.len, elapsed_ns(t0));
+        pl.hash.sample_depth(pl.verify.size());
+        pl.verify.push(job); // cannot fail: capacity covers every buffer
+    }
+}
+
+static void verify_stage(Pipeline& pl, DownloadStatus& ds) {
+    Backoff idle;
+    while(pl.outstanding > 0) {
+        PieceJob job;
+        if(!pl.verify.pop(job)) { idle.pause(); continue; }
+        idle.reset();
+
+        const JobFile& f = ds.files[ds.piece_file[job.idx]];
+        if(f.merkle) { // checked block by block in recv_piece
+            pl.disk.sample_depth(pl.write.size());
+            pl.write.push(job);
+            continue;
+        }
+        auto t0 = chrono::steady_clock::now();
+        char computed[41];
+        sha1_hex(pl.bufs[job.buf], job.len, computed);
+        bool ok = f.hashes[f.piece_of(job.idx)] == computed;
+        pl.hash.record(job.len, elapsed_ns(t0));
+
+        if(ok) {
+            pl.disk.sample_depth(pl.write.size());
+            pl.write.push(job);
+            continue;
+        }
+        job.peer->hash_failures++;
+        job.peer->health.failed();
+        ds.hash_failures++;
+        pl.free_bufs.push(job.buf);
+        if(++job.attempt < max_attempts(ds, f)) {
+            ds.retries++;
+            pl.work.push(job); // retried with the bad peer now in backoff
+        } else {
+            drop_piece(pl, ds);
+        }
     }
+}
 
-    ssize_t w = write(out_fd, buf.data(), n);
-    close(out_fd);
-    close(fd);
+// disk stage: drains whatever is queued and writes it as one batch, one
+// flush per file it touches
+static void write_stage(Pipeline& pl, DownloadStatus& ds) {
+    Backoff idle;
+    vector<PieceJob> batch;
+    map<int, bool> touched; // files[] index -> flush succeeded
+    while(pl.outstanding > 0) {
+        PieceJob job;
+        while((int)batch.size() < PIPELINE_BUFS && pl.write.pop(job)) batch.push_back(job);
+        if(batch.empty()) { idle.pause(); continue; }
+        idle.reset();
+
+        auto t0 = chrono::steady_clock::now();
+        uint64_t nbytes = 0;
+        for(auto& j : batch) {
+            int fi = ds.piece_file[j.idx];
+            JobFile& f = ds.files[fi];
+            if(!f.out) {
+                auto o = make_shared<PieceFile>();
+                if(o->open(f.dest, f.to - f.from)) f.out = o;
+            }
+            if(!f.out) {
+                touched[fi] = false;
+                continue;
+            }
+            uint32_t skip, n;
+            uint64_t at;
+            f.clip(f.piece_of(j.idx), j.len, skip, n, at);
+            f.out->queue_write(pl.bufs[j.buf] + skip, n, at);
+            touched.emplace(fi, true);
+            nbytes += n;
+        }
+        for(auto& t : touched) {
+            if(t.second) t.second = ds.files[t.first].out->flush();
+        }
+        pl.disk.record(nbytes, elapsed_ns(t0), batch.size());
+
+        for(auto& j : batch) {
+            JobFile& f = ds.files[ds.piece_file[j.idx]];
+            if(touched[ds.piece_file[j.idx]]) {
+                if(--f.left == 0) f.out->close();
+                {
+                    lock_guard<mutex> lg(ds.m);
+                    ds.have[j.idx] = 1;
+                }
+                uint32_t skip, n;
+                uint64_t at;
+                f.clip(f.piece_of(j.idx), j.len, skip, n, at);
+                ds.have_count++;
+                ds.written.add(n);
+                ds.remaining--;
+            }
+            pl.free_bufs.push(j.buf);
+            pl.outstanding--;
+        }
+        batch.clear();
+        touched.clear();
+    }
+}
 
-    return w == (ssize_t)n;
+// streaming disk stage: holds verified pieces until they are next in line,
+// then writes the contiguous run to stream_fd. If the reader goes away the
+// job stops.
+static void stream_stage(Pipeline& pl, DownloadStatus& ds) {
+    Backoff idle;
+    map<int, PieceJob> held; // out-of-order pieces, never more than ds.window
+    while(pl.outstanding > 0) {
+        PieceJob job;
+        bool got = false;
+        while(pl.write.pop(job)) {
+            held[job.idx] = job;
+            got = true;
+        }
+        if(!got) { idle.pause(); continue; }
+        idle.reset();
+
+        auto t0 = chrono::steady_clock::now();
+        uint64_t nbytes = 0, n = 0;
+        for(auto it = held.begin(); it != held.end() && it->first == ds.next_emit; it = held.erase(it)) {
+            const PieceJob& j = it->second;
+            const JobFile& f = ds.files[ds.piece_file[j.idx]];
+            uint32_t skip, len;
+            uint64_t at;
+            f.clip(f.piece_of(j.idx), j.len, skip, len, at);
+            if(!write_all(ds.stream_fd, pl.bufs[j.buf] + skip, len)) {
+                pl.outstanding = 0;
+                break;
+            }
+            {
+                lock_guard<mutex> lg(ds.m);
+                ds.have[j.idx] = 1;
+            }
+            ds.have_count++;
+            ds.written.add(len);
+            ds.remaining--;
+            ds.next_emit++;
+            nbytes += len;
+            n++;
+            pl.free_bufs.push(j.buf);
+            pl.outstanding--;
+        }
+        if(n) pl.disk.record(nbytes, elapsed_ns(t0), n);
+    }
+    for(auto& h : held) pl.free_bufs.push(h.second.buf);
 }
 
-void run_download_job(string g, string fname, string dest, vector<string> hashes, vector<string> peers, uint64_t fsz, string fsha) {
-    auto ds = make_shared<DownloadStatus>();
-    ds->group = g; ds->filename = fname; ds->dest = dest; ds->npieces = hashes.size();
-    ds->have.assign(hashes.size(), 0); ds->remaining = hashes.size();
-    ds->completed = false; ds->running = true;
+// Lay the files out one after another in job-wide piece order and merge
+// their peer lists into ds->peers.
+static void add_job_files(DownloadStatus& ds, vector<JobFile> files, const vector<vector<string>>& peers) {
+    map<string, int> peer_idx;
+    for(size_t i = 0; i < files.size(); i++) {
+        JobFile& f = files[i];
+        f.merkle = f.hashes.empty() && f.size > 0 && digest_from_hex(f.sha, f.root);
+        if(f.merkle) f.leaves.resize((f.size + MERKLE_BLOCK - 1) / MERKLE_BLOCK);
+        if(!f.to) f.to = f.size;
+        f.first = (int)ds.piece_file.size();
+        f.left = f.span();
+        ds.piece_file.insert(ds.piece_file.end(), f.left, (int)i);
+        ds.size += f.to - f.from;
+        for(auto& p : peers[i]) {
+            auto it = peer_idx.find(p);
+            if(it == peer_idx.end()) {
+                it = peer_idx.emplace(p, (int)ds.peers.size()).first;
+                ds.peers.push_back(unique_ptr<PeerStats>(new PeerStats(p)));
+            }
+            f.peers.push_back(it->second);
+            pex.learn(f.sha, p);
+        }
+    }
+    ds.files = move(files);
+    ds.npieces = (int)ds.piece_file.size();
+    ds.have.assign(ds.npieces, 0);
+    ds.remaining = ds.npieces;
+}
 
+static bool file_complete(DownloadStatus& ds, const JobFile& f) {
+    lock_guard<mutex> g(ds.m);
+    for(int i = 0; i < f.span(); i++) if(!ds.have[f.first + i]) return false;
+    return true;
+}
+
+// A finished download tells a few of the peers it fetched from that it now
+// holds the files too, so they hand it out to later PEX requests.
+static void announce_holder(shared_ptr<DownloadStatus> ds) {
+    const int MAX_MSGS = 12;
+    string self = my_peer_addr();
+    vector<pair<string, string>> msgs; // peer, sha
     {
-        lock_guard<mutex> g_dl(downloads_mtx);
-        downloads[g + ":" + fname] = ds;
-    }
-
-    int batch = min(MAX_SIM_PIECES, (int)hashes.size());
-    for(int start = 0; start < (int)hashes.size(); start += batch) {
-        int end = min(start + batch, (int)hashes.size());
-        vector<thread> threads;
-
-        for(int idx = start; idx < end; idx++) {
-            threads.push_back(thread([idx, fname, dest, ds, &hashes, &peers]() {
-                string hash = hashes[idx];
-                bool success = false;
-
-                for(const auto& peer : peers) {
-                    for(int retry = 0; retry < 2; retry++) {
-                        if(fetch_one_piece(peer, fname, idx, dest, hash)) {
-                            {
-                                lock_guard<mutex> lg(ds->m);
-                                ds->have[idx] = 1;
-                            }
-                            ds->remaining--;
-                            success = true;
-                            break;
-                        }
-                    }
-                    if(success) break;
-                }
-            }));
+        lock_guard<mutex> g(ds->peers_m);
+        for(auto& f : ds->files) {
+            if(f.partial() || !file_complete(*ds, f)) continue;
+            int sent = 0;
+            for(int i : f.peers) {
+                if(!ds->peers[i]->pieces || sent == DIAL_RACE_WIDTH || (int)msgs.size() == MAX_MSGS) continue;
+                msgs.push_back(make_pair(ds->peers[i]->addr, f.sha));
+                sent++;
+            }
         }
+    }
+    for(auto& m : msgs) {
+        int fd = connect_endpoint(m.first);
+        if(fd < 0) continue;
+        struct timeval timeout = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string rep;
+        pex_sent++;
+        if(send_msg(fd, "PEX " + m.second + " " + self) && recv_msg(fd, rep)) {
+            for(auto& a : split_ws(rep)) {
+                if(a.compare(0, 3, "ERR") != 0) pex.learn(m.second, a);
+            }
+        }
+        close(fd);
+    }
+}
+
+// Serve a finished Merkle-mode file. Every leaf was verified on the way in,
+// so the tree is rebuilt from them, not from disk. Caller holds uploaded_mtx.
+static void share_merkle(const JobFile& f) {
+    auto t = make_shared<MerkleTree>();
+    t->build(f.leaves);
+    merkle_trees[f.sha] = t;
+}
 
-        for(auto& t : threads) {
-            if(t.joinable()) t.join();
+void run_download_job(shared_ptr<DownloadStatus> ds) {
+    if(!ds->stream_path.empty()) {
+        ds->stream_fd = open(ds->stream_path.c_str(), O_WRONLY); // blocks this job only, until a reader attaches
+        if(ds->stream_fd < 0) {
+            cout << "cannot open " << ds->stream_path << endl;
+            return;
         }
     }
+    ds->completed = false; ds->running = true;
+    int missing = ds->remaining; // less than npieces when a delta update reused local pieces
+    auto pl = make_shared<Pipeline>(missing, max(1, min(PIPELINE_BUFS, missing)));
+    ds->pipe = pl;
+    ds->window = (int)pl->bufs.size(); // one buffer per piece in the window, so the next piece can always get one
+
+    {
+        lock_guard<mutex> g_dl(downloads_mtx);
+        downloads[ds->group + ":" + ds->filename] = ds;
+    }
+
+    for(int idx = 0; idx < ds->npieces; idx++) {
+        if(ds->have[idx]) continue;
+        PieceJob job = {idx, 0, nullptr, -1, 0};
+        pl->work.push(job);
+    }
 
+    vector<thread> stages;
+    for(int i = 0; i < min(MAX_SIM_PIECES, ds->npieces); i++) {
+        stages.push_back(thread(recv_stage, ref(*pl), ref(*ds)));
+    }
+    for(int i = 0; i < HASH_WORKERS; i++) {
+        stages.push_back(thread(verify_stage, ref(*pl), ref(*ds)));
+    }
+    stages.push_back(thread(ds->stream_fd >= 0 ? stream_stage : write_stage, ref(*pl), ref(*ds)));
+    for(auto& t : stages) t.join();
+    pl->wall_ns = elapsed_ns(pl->started);
+    pl->release_bufs();
+
+    for(auto& f : ds->files) {
+        if(f.out) f.out->close();
+    }
     ds->running = false;
-    if(ds->remaining == 0) {
-        ds->completed = true;
-        cout << "[C] " << g << " " << fname << endl;
 
-        vector<string> temp_pieces;
-        string temp_hash;
-        uint64_t temp_size;
-        compute_piece_and_file_sha1(dest, temp_pieces, temp_hash, temp_size);
+    if(ds->stream_fd >= 0) {
+        // the reader sees EOF; nothing is on disk to share
+        close(ds->stream_fd);
+        ds->completed = ds->remaining == 0;
+        cout << (ds->completed ? "[C] " : "[P] ") << ds->group << " " << ds->filename << " streamed "
+             << ds->next_emit << "/" << ds->npieces << " pieces" << endl;
+        return;
+    }
+
+    if(!ds->tree) {
+        if(ds->remaining != 0) return;
+        ds->completed = true;
+        const JobFile& f = ds->files[0];
+        if(f.partial()) { // a slice is not the file, so it is not shared
+            cout << "[C] " << ds->group << " " << f.name << " bytes " << f.from << "-" << f.to - 1 << endl;
+            return;
+        }
+        cout << "[C] " << ds->group << " " << f.name << endl;
+
+        bool ok = f.merkle;
+        if(!ok) {
+            vector<string> temp_pieces;
+            string temp_hash;
+            uint64_t temp_size;
+            compute_piece_and_file_sha1(f.dest, temp_pieces, temp_hash, temp_size);
+            ok = temp_hash == f.sha && temp_size == f.size;
+        }
+        if(ok) {
+            remember_hashes(f.dest, f.merkle, f.merkle ? raw_leaves(f.leaves) : raw_digests(f.hashes));
+            hash_cache.save();
+        }
 
-        if(temp_hash == fsha && temp_size == fsz) {
-            string peer_addr = "127.0.0.1:" + to_string(peer_port);
+        if(ok) {
             string rep;
-            tracker_roundtrip("ADD_PEER " + g + " " + fname + " " + peer_addr, rep);
+            tracker_roundtrip("ADD_PEER " + ds->group + " " + f.name + " " + my_peer_addr(), rep);
 
-            lock_guard<mutex> g_uf(uploaded_mtx);
-            uploaded_files[fname] = dest;
+            {
+                lock_guard<mutex> g_uf(uploaded_mtx);
+                uploaded_files[f.name] = f.dest;
+                shared_content[f.sha] = f.dest;
+                share_table[ds->group + " " + f.name] = Share{f.dest, f.sha, f.merkle};
+                if(f.merkle) share_merkle(f);
+            }
+            save_shares();
+            announce_holder(ds);
+        }
+        return;
+    }
+
+    // every piece was verified and the piece list was checked against the
+    // file sha up front, so complete files are shared without re-reading them
+    string add = "ADD_PEERS " + ds->group + " " + my_peer_addr();
+    size_t done = 0;
+    {
+        lock_guard<mutex> g_uf(uploaded_mtx);
+        for(auto& f : ds->files) {
+            if(!file_complete(*ds, f)) continue;
+            remember_hashes(f.dest, f.merkle, f.merkle ? raw_leaves(f.leaves) : raw_digests(f.hashes));
+            uploaded_files[f.name] = f.dest;
+            shared_content[f.sha] = f.dest;
+            share_table[ds->group + " " + f.name] = Share{f.dest, f.sha, f.merkle};
+            if(f.merkle) share_merkle(f);
+            add += " " + f.name;
+            done++;
         }
     }
+    if(done) {
+        hash_cache.save();
+        save_shares();
+        string rep;
+        tracker_roundtrip(add, rep);
+        announce_holder(ds);
+    }
+    ds->completed = ds->remaining == 0;
+    cout << (ds->completed ? "[C] " : "[P] ") << ds->group << " " << ds->filename << "/ " << done << "/"
+         << ds->files.size() << " files" << endl;
+}
+
+static string format_eta(double secs) {
+    if(secs < 0 || secs > 359999) return "--:--";
+    char buf[32];
+    int t = (int)(secs + 0.5);
+    if(t >= 3600) snprintf(buf, sizeof(buf), "%d:%02d:%02d", t / 3600, t / 60 % 60, t % 60);
+    else snprintf(buf, sizeof(buf), "%02d:%02d", t / 60, t % 60);
+    return buf;
 }
 
+// Reads atomics and, briefly, peers_m, so it never waits on a transfer.
 void print_downloads() {
     lock_guard<mutex> g(downloads_mtx);
     if(downloads.empty()) {
@@ -388,17 +1898,91 @@ void print_downloads() {
         auto ds = kv.second;
         if(!ds) continue;
 
-        lock_guard<mutex> g_ds(ds->m);
-        int have = 0;
-        for(int v : ds->have) if(v) have++;
-
+        int have = ds->have_count;
         if(ds->completed) {
             printf("[C] %s %s\n", ds->group.c_str(), ds->filename.c_str());
-        } else if(ds->running) {
-            printf("[D] %s %s - %d/%d\n", ds->group.c_str(), ds->filename.c_str(), have, ds->npieces);
-        } else if(have > 0) {
-            printf("[P] %s %s - %d/%d\n", ds->group.c_str(), ds->filename.c_str(), have, ds->npieces);
+            continue;
+        } else if(!ds->running && have == 0) {
+            continue;
         }
+
+        double rate = ds->written.rate();
+        uint64_t done = ds->written.total + ds->reused_bytes;
+        double eta = rate > 0 ? (ds->size - min(done, ds->size)) / rate : -1;
+        printf("[%c] %s %s - %d/%d %.1f%% %.2f MB/s ETA %s retries=%llu hash_fail=%llu pex=+%llu\n",
+               ds->running ? 'D' : 'P', ds->group.c_str(), ds->filename.c_str(), have, ds->npieces,
+               ds->size ? 100.0 * done / ds->size : 100.0, rate / 1048576.0,
+               ds->running ? format_eta(eta).c_str() : "--:--",
+               (unsigned long long)ds->retries.load(), (unsigned long long)ds->hash_failures.load(),
+               (unsigned long long)ds->pex_added.load());
+
+        if(!ds->running) continue;
+        lock_guard<mutex> g_p(ds->peers_m);
+        for(auto& ps : ds->peers) {
+            printf("    %-21s pieces=%llu MB=%.1f %.2f MB/s fail=%llu hash_fail=%llu%s\n", ps->addr.c_str(),
+                   (unsigned long long)ps->pieces.load(), ps->bytes.total / 1048576.0, ps->bytes.rate() / 1048576.0,
+                   (unsigned long long)ps->failures.load(), (unsigned long long)ps->hash_failures.load(),
+                   ps->health.avoided(now_ms()) ? " backoff" : "");
+        }
+    }
+}
+
+static void print_stage(const char *name, const StageStats& st, double wall_s) {
+    double mb = st.bytes / 1048576.0, busy_s = st.busy_ns / 1e9;
+    double avg_depth = st.depth_samples ? (double)st.depth_sum / st.depth_samples : 0.0;
+    printf("  %-6s pieces=%llu MB=%.1f per-worker=%.1f MB/s wall=%.1f MB/s queue avg=%.1f max=%llu\n",
+           name, (unsigned long long)st.items.load(), mb, busy_s > 0 ? mb / busy_s : 0.0,
+           wall_s > 0 ? mb / wall_s : 0.0, avg_depth, (unsigned long long)st.depth_max.load());
+}
+
+// each tracker's probe state, marking the one that takes writes
+void print_trackers() {
+    string preferred;
+    {
+        lock_guard<mutex> g(tracker_mtx);
+        preferred = connected_tracker;
+    }
+    for(auto& h : tracker_health) {
+        printf("%-21s %-4s rtt=%.2f ms probes=%llu failed=%llu%s\n", h->ep.c_str(), h->up ? "up" : "down",
+               h->rtt_ms.load(), (unsigned long long)h->probes.load(), (unsigned long long)h->failures.load(),
+               h->ep == preferred ? " (writes)" : "");
+    }
+}
+
+// per-stage throughput and queue occupancy of every download pipeline
+void print_pipeline_stats() {
+    // every acquire() used to be a fresh 512 KiB allocation
+    double up_s = elapsed_ns(client_start) / 1e9;
+    uint64_t req = piece_pool.requests(), alloc = piece_pool.allocs();
+    printf("piece buffers: %llu requests (%.1f/s), %llu heap allocs (%.1f/s), %llu freed\n",
+           (unsigned long long)req, req / up_s, (unsigned long long)alloc, alloc / up_s,
+           (unsigned long long)piece_pool.frees());
+    printf("hash cache: %zu files, %llu hits, %llu misses\n", hash_cache.size(),
+           (unsigned long long)hash_cache.hits.load(), (unsigned long long)hash_cache.misses.load());
+    printf("piece compression: received %llu compressed (%.1f MB wire for %.1f MB) and %llu raw; "
+           "served %llu compressed (%llu from cache), %llu raw\n",
+           (unsigned long long)z_recv.load(), z_wire_bytes / 1e6, z_plain_bytes / 1e6,
+           (unsigned long long)z_recv_raw.load(), (unsigned long long)z_served.load(),
+           (unsigned long long)z_cache_hits.load(), (unsigned long long)z_served_raw.load());
+    printf("peer exchange: %llu requests sent, %llu peers learned; served %llu, refused %llu\n",
+           (unsigned long long)pex_sent.load(), (unsigned long long)pex_learned.load(),
+           (unsigned long long)pex_served.load(), (unsigned long long)pex_refused.load());
+
+    lock_guard<mutex> g(downloads_mtx);
+    if(downloads.empty()) {
+        cout << "No active downloads" << endl;
+        return;
+    }
+
+    for(auto& kv : downloads) {
+        auto pl = kv.second ? kv.second->pipe : nullptr;
+        if(!pl) continue;
+        uint64_t wall = pl->wall_ns ? pl->wall_ns.load() : elapsed_ns(pl->started);
+        double wall_s = wall / 1e9;
+        printf("%s %s (%.2fs)\n", kv.second->group.c_str(), kv.second->filename.c_str(), wall_s);
+        print_stage("recv", pl->recv, wall_s);
+        print_stage("verify", pl->hash, wall_s);
+        print_stage("write", pl->disk, wall_s);
     }
 }
 
@@ -428,13 +2012,319 @@ vector<string> parse_hashes(const string& line) {
     return hashes;
 }
 
-bool parse_download_cmd(const string& line, string& group, string& filename, string& dest) {
+// One GET_FILE_PEERS reply (also one GET_DIR entry): size and piece count,
+// file sha, piece digests, an optional "VERSION <n> <previous sha>" line,
+// "PEERS", then peers up to a blank line or the end.
+bool parse_file_peers(istream& iss, uint64_t& fsz, string& sha, vector<string>& hashes, vector<string>& peers,
+                      string *prev_sha = nullptr) {
+    int np;
+    string line;
+    if(!(iss >> fsz >> np)) return false;
+    getline(iss, line);
+    getline(iss, sha);
+    getline(iss, line);
+    hashes = parse_hashes(line);
+    if((int)hashes.size() != np) return false;
+
+    while(getline(iss, line) && line != "PEERS") {
+        if(prev_sha && line.compare(0, 8, "VERSION ") == 0) *prev_sha = line.substr(line.find(' ', 8) + 1);
+    }
+    peers.clear();
+    while(getline(iss, line) && !line.empty()) peers.push_back(line);
+    return true;
+}
+
+// Regular files under root/rel, relative to root. Names with whitespace
+// cannot travel in the tracker protocol, so they are counted and skipped.
+static void walk_tree(const string& root, const string& rel, vector<string>& out, size_t& skipped) {
+    string dir = rel.empty() ? root : root + "/" + rel;
+    DIR *d = opendir(dir.c_str());
+    if(!d) return;
+    while(dirent *e = readdir(d)) {
+        string name = e->d_name;
+        if(name == "." || name == "..") continue;
+        string r = rel.empty() ? name : rel + "/" + name;
+        struct stat st;
+        if(lstat((root + "/" + r).c_str(), &st) != 0) continue;
+        if(S_ISDIR(st.st_mode)) {
+            walk_tree(root, r, out, skipped);
+        } else if(S_ISREG(st.st_mode)) {
+            if(r.find_first_of(" \t\r\n") != string::npos) skipped++;
+            else out.push_back(r);
+        }
+    }
+    closedir(d);
+}
+
+// mkdir -p for the directories leading up to path
+static void make_parent_dirs(const string& path) {
+    for(size_t p = path.find('/', 1); p != string::npos; p = path.find('/', p + 1)) {
+        mkdir(path.substr(0, p).c_str(), 0755);
+    }
+}
+
+// Share every regular file under root as "<basename>/<relative path>". Files
+// are hashed on all cores, then registered with one UPLOAD_MANIFEST: one
+// tracker transaction, one save() and one replication op for the whole tree.
+static void upload_dir(const string& g, string root) {
+    while(root.size() > 1 && root.back() == '/') root.pop_back();
+    string base = root.substr(root.find_last_of('/') + 1);
+    vector<string> rels;
+    size_t skipped = 0;
+    walk_tree(root, "", rels, skipped);
+    if(rels.empty() || base.empty() || base == "." || base == "..") {
+        cout << "no files under " << root << endl;
+        return;
+    }
+
+    struct Hashed { vector<string> pieces; string sha; uint64_t size = 0; shared_ptr<MerkleTree> tree; };
+    vector<Hashed> hashed(rels.size());
+    auto t0 = chrono::steady_clock::now();
+    uint64_t hits0 = hash_cache.hits;
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    int nworkers = (int)min<size_t>(rels.size(), max(2u, thread::hardware_concurrency()));
+    for(int w = 0; w < nworkers; w++) {
+        workers.push_back(thread([&]() {
+            for(size_t i; (i = next++) < rels.size();) {
+                Hashed& h = hashed[i];
+                hash_for_share(root + "/" + rels[i], merkle_uploads, h.pieces, h.sha, h.size, h.tree);
+            }
+        }));
+    }
+    for(auto& t : workers) t.join();
+    double hash_s = elapsed_ns(t0) / 1e9;
+    uint64_t cached = hash_cache.hits - hits0;
+    hash_cache.save();
+
+    string peer = my_peer_addr();
+    string msg;
+    size_t n = 0;
+    uint64_t bytes = 0;
+    for(size_t i = 0; i < rels.size(); i++) {
+        Hashed& h = hashed[i];
+        if(!h.size) { skipped++; continue; } // empty or unreadable
+        msg += " " + base + "/" + rels[i] + " " + to_string(h.size) + " " + to_string(h.pieces.size()) + " " + h.sha;
+        for(auto& ph : h.pieces) msg += " " + ph;
+        n++;
+        bytes += h.size;
+    }
+    msg = "UPLOAD_MANIFEST " + g + " " + peer + " " + current_user + " " + to_string(n) + msg;
+    if(!n || msg.size() > MAX_BULK_MSG_BYTES - 64) {
+        cout << (n ? "manifest too large, upload subdirectories separately" : "no readable files") << endl;
+        return;
+    }
+
+    {
+        lock_guard<mutex> g_uf(uploaded_mtx);
+        for(size_t i = 0; i < rels.size(); i++) {
+            if(!hashed[i].size) continue;
+            uploaded_files[base + "/" + rels[i]] = root + "/" + rels[i];
+            shared_content[hashed[i].sha] = root + "/" + rels[i];
+            share_table[g + " " + base + "/" + rels[i]] = Share{root + "/" + rels[i], hashed[i].sha, hashed[i].tree != nullptr};
+            if(hashed[i].tree) merkle_trees[hashed[i].sha] = hashed[i].tree;
+        }
+    }
+    save_shares();
+
+    string rep;
+    if(!tracker_roundtrip(msg, rep)) {
+        cout << "All trackers unreachable" << endl;
+        return;
+    }
+    cout << rep << endl;
+    if(rep.compare(0, 2, "OK") == 0) {
+        printf("%zu files, %.1f MB hashed in %.2fs on %d threads (%llu from the hash cache)%s\n", n,
+               bytes / 1048576.0, hash_s, nworkers, (unsigned long long)cached,
+               skipped ? (", " + to_string(skipped) + " skipped").c_str() : "");
+    }
+}
+
+// Delta update: pieces the new version shares with the previous one, held
+// locally at old, are taken from disk instead of the swarm. Each is
+// re-hashed first, so a stale or edited local copy only costs a fetch. In
+// place (old is the destination) only pieces at their old index are kept;
+// moving any other would overwrite data before it was read. Returns the
+// number of pieces reused.
+static int reuse_previous_version(DownloadStatus& ds, const string& old, const vector<string>& old_hashes) {
+    JobFile& f = ds.files[0];
+    bool in_place = old == f.dest;
+    int fd = open(old.c_str(), O_RDONLY);
+    if(fd < 0) return 0;
+
+    unordered_map<string, int> where;
+    for(int j = (int)old_hashes.size() - 1; j >= 0; j--) where[old_hashes[j]] = j;
+
+    PooledBuf buf(piece_pool);
+    int reused = 0;
+    for(int i = 0; i < f.npieces(); i++) {
+        auto it = where.find(f.hashes[i]);
+        if(it == where.end() || (in_place && it->second != i)) continue;
+        size_t len = (size_t)min<uint64_t>(PIECE_SZ, f.size - (uint64_t)i * PIECE_SZ);
+        char h[41];
+        if(pread(fd, buf.get(), len, (off_t)it->second * PIECE_SZ) != (ssize_t)len) continue;
+        sha1_hex(buf.get(), len, h);
+        if(f.hashes[i] != h) continue;
+        if(!in_place && !f.out->write_at(buf.get(), len, (uint64_t)i * PIECE_SZ)) continue;
+        ds.have[i] = 1;
+        ds.have_count++;
+        ds.remaining--;
+        ds.reused_bytes += len;
+        f.left--;
+        reused++;
+    }
+    close(fd);
+    return reused;
+}
+
+// GET_FILE_PEERS one file and set it up as a job. dest may be a path, a
+// directory, a FIFO or "-" (the last two stream). len > 0 limits the job
+// to bytes [from, from + len) and the pieces covering them.
+static shared_ptr<DownloadStatus> prepare_file_download(const string& g, const string& fname, const string& dest,
+                                                        uint64_t from, uint64_t len) {
+    string rep;
+    if(!tracker_roundtrip("GET_FILE_PEERS " + g + " " + fname + " " + current_user, rep)) {
+        cout << "All trackers unreachable" << endl;
+        return nullptr;
+    }
+
+    if(rep.rfind("ERR", 0) == 0) { cout << rep << endl; return nullptr; }
+
+    istringstream iss(rep);
+    uint64_t fsz;
+    string file_sha, prev_sha;
+    vector<string> hashes, peers;
+    if(!parse_file_peers(iss, fsz, file_sha, hashes, peers, &prev_sha)) {
+        cout << "Error: hash count mismatch" << endl;
+        return nullptr;
+    }
+
+    if(peers.empty()) { cout << "No peers available" << endl; return nullptr; }
+    bool whole = !len;
+    if(!len) len = fsz - from;
+    if(from >= fsz || len > fsz - from) { cout << "range outside file of " << fsz << " bytes" << endl; return nullptr; }
+
+    // "-" (stdout, with --data-stdout) or a FIFO streams the file in order
+    struct stat st;
+    string outpath = dest, old_copy, fifo;
+    int stream_fd = -1;
+    shared_ptr<PieceFile> out;
+    if(dest == "-") {
+        stream_fd = stdout_data_fd.exchange(-1);
+        if(stream_fd < 0) { cout << "stdout streaming needs --data-stdout (once per session)" << endl; return nullptr; }
+    } else if(stat(dest.c_str(), &st) == 0 && S_ISFIFO(st.st_mode)) {
+        fifo = dest;
+    } else {
+        if(stat(dest.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            outpath = dest + "/" + fname;
+        }
+        // a whole-file download over a previous version we hold: find that copy
+        // before the destination is resized
+        if(whole && !prev_sha.empty() && !hashes.empty()) {
+            lock_guard<mutex> g_uf(uploaded_mtx);
+            auto it = shared_content.find(prev_sha);
+            if(it != shared_content.end()) old_copy = it->second;
+            else if(stat(outpath.c_str(), &st) == 0 && S_ISREG(st.st_mode)) old_copy = outpath;
+            // an updated-in-place copy must stop being served as the old content
+            if(old_copy == outpath && it != shared_content.end()) shared_content.erase(it);
+        }
+        out = make_shared<PieceFile>();
+        if(!out->open(outpath, len)) { cout << "cannot create " << dest << endl; return nullptr; }
+    }
+
+    auto ds = make_shared<DownloadStatus>();
+    ds->group = g; ds->dest = outpath; ds->stream_fd = stream_fd; ds->stream_path = fifo;
+    ds->filename = len == fsz ? fname : fname + "@" + to_string(from) + "+" + to_string(len);
+    JobFile f;
+    f.name = fname; f.sha = file_sha; f.dest = outpath; f.size = fsz; f.hashes = hashes; f.out = out;
+    f.from = from; f.to = from + len;
+    add_job_files(*ds, vector<JobFile>(1, f), vector<vector<string>>(1, peers));
+
+    string vrep;
+    if(!old_copy.empty() && tracker_roundtrip("GET_VERSION " + g + " " + fname + " " + current_user, vrep) &&
+       vrep.rfind("ERR", 0) != 0) {
+        // "<version> <sha> <n>\n<h1,h2,...>", checked against the sha it claims
+        istringstream vs(vrep);
+        string ver, vsha, line;
+        size_t n = 0;
+        vs >> ver >> vsha >> n;
+        getline(vs, line);
+        getline(vs, line);
+        vector<string> old_hashes = parse_hashes(line);
+        string concat;
+        for(auto& h : old_hashes) concat += h;
+        char fh[41];
+        sha1_hex((const uint8_t*)concat.data(), concat.size(), fh);
+        if(vsha == prev_sha && fh == prev_sha && old_hashes.size() == n) {
+            int k = reuse_previous_version(*ds, old_copy, old_hashes);
+            cout << "delta from version " << ver << ": " << k << "/" << ds->npieces << " pieces reused from "
+                 << old_copy << endl;
+        }
+    }
+    return ds;
+}
+
+// GET_DIR the tree and lay every file out as one job. Names are checked to
+// stay under dest, and each piece list against its file sha (Merkle-mode
+// pieces are proven against the root as they arrive), so finished files can
+// be shared without re-hashing them.
+static shared_ptr<DownloadStatus> prepare_dir_download(const string& g, const string& dir, const string& dest) {
+    string rep;
+    if(!tracker_roundtrip("GET_DIR " + g + " " + dir + " " + current_user, rep)) {
+        cout << "All trackers unreachable" << endl;
+        return nullptr;
+    }
+    if(rep.rfind("ERR", 0) == 0) { cout << rep << endl; return nullptr; }
+
+    istringstream iss(rep);
+    size_t count = 0, no_peers = 0;
+    string line;
+    iss >> count;
+    getline(iss, line);
+
+    vector<JobFile> files;
+    vector<vector<string>> peers;
+    for(size_t i = 0; i < count && getline(iss, line); i++) {
+        JobFile f;
+        vector<string> fp;
+        if(line.compare(0, 5, "FILE ") != 0 || !parse_file_peers(iss, f.size, f.sha, f.hashes, fp)) {
+            cout << "Error: malformed directory listing" << endl;
+            return nullptr;
+        }
+        f.name = line.substr(5);
+        string concat;
+        for(auto& h : f.hashes) concat += h;
+        char fh[41];
+        sha1_hex((const uint8_t*)concat.data(), concat.size(), fh);
+        Digest root;
+        bool sha_ok = f.hashes.empty() ? f.size > 0 && digest_from_hex(f.sha, root) : f.sha == fh;
+        if(f.name.compare(0, dir.size() + 1, dir + "/") != 0 || ("/" + f.name + "/").find("/../") != string::npos ||
+           !sha_ok) {
+            cout << "Error: bad entry " << f.name << endl;
+            return nullptr;
+        }
+        if(fp.empty()) { no_peers++; continue; }
+        f.dest = dest + "/" + f.name;
+        make_parent_dirs(f.dest);
+        files.push_back(move(f));
+        peers.push_back(move(fp));
+    }
+    if(files.empty()) { cout << "No peers available" << endl; return nullptr; }
+    if(no_peers) cout << no_peers << " file(s) have no peers and are skipped" << endl;
+
+    auto ds = make_shared<DownloadStatus>();
+    ds->group = g; ds->filename = dir; ds->dest = dest; ds->tree = true;
+    add_job_files(*ds, move(files), peers);
+    return ds;
+}
+
+bool parse_download_cmd(const string& line, const string& cmd, string& group, string& filename, string& dest) {
     string cleaned = line;
     size_t amp = cleaned.find_last_of('&');
     if(amp != string::npos) cleaned = cleaned.substr(0, amp);
 
     auto tokens = split_ws(cleaned);
-    if(tokens.size() != 4 || tokens[0] != "download_file") return false;
+    if(tokens.size() != 4 || tokens[0] != cmd) return false;
 
     group = tokens[1]; filename = tokens[2]; dest = tokens[3];
     return true;
@@ -442,18 +2332,52 @@ bool parse_download_cmd(const string& line, string& group, string& filename, str
 
 int main(int argc, char **argv) {
     if(argc < 3) {
-        cerr << "Usage: client <tracker_ip:port> tracker_info.txt\n";
+        cerr << "Usage: client <tracker_ip:port> tracker_info.txt [--dial-timeout MS] [--no-compress] [--merkle] [--data-stdout]\n"
+                "              [--data-dir DIR] [--reverify SECS] [--port N]\n";
         return 1;
     }
+    for(int i = 3; i < argc; i++) {
+        string a = argv[i];
+        if(a == "--dial-timeout" && i + 1 < argc) dial_timeout_ms = max(1, atoi(argv[++i]));
+        else if(a == "--no-compress") compress_pieces = false;
+        else if(a == "--merkle") merkle_uploads = true;
+        else if(a == "--data-dir" && i + 1 < argc) client_data_dir = argv[++i];
+        else if(a == "--port" && i + 1 < argc) listen_port = max(0, atoi(argv[++i]));
+        else if(a == "--reverify" && i + 1 < argc) reverify_secs = max(0, atoi(argv[++i]));
+        else if(a == "--data-stdout") {
+            // stdout is reserved for a streamed download; the console moves to stderr
+            fflush(stdout);
+            stdout_data_fd = dup(1);
+            dup2(2, 1);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN); // a stream reader or peer hanging up is a write error, not fatal
 
     connected_tracker = argv[1];
 
     ifstream ifs(argv[2]);
     string l;
     while(getline(ifs, l) && !l.empty()) trackers.push_back(l);
-
-    start_peer_server();
+    if(find(trackers.begin(), trackers.end(), connected_tracker) == trackers.end()) {
+        trackers.insert(trackers.begin(), connected_tracker);
+    }
+    start_tracker_probes();
+
+    mkdir(client_data_dir.c_str(), 0755);
+    int last_port = 0;
+    own_data_dir = lock_data_dir();
+    if(own_data_dir) {
+        hash_cache.load(client_data_dir + "/hash_cache.snap");
+        last_port = load_shares();
+    } else {
+        cerr << client_data_dir << " is in use by another client; shares will not be saved or resumed"
+             << " (use --data-dir)" << endl;
+    }
+    start_peer_server(listen_port ? listen_port : last_port);
     printf("Peer server listening on port %d\n", peer_port);
+    resume_shares();
+    thread(heartbeat_thread).detach();
+    if(reverify_secs > 0) thread(reverify_thread).detach();
 
     string line;
     while(true) {
@@ -535,18 +2459,27 @@ int main(int argc, char **argv) {
             string g = tokens[1], path = tokens[2];
             vector<string> piece_hash;
             string file_hash;
-            uint64_t fsz;
+            uint64_t fsz = 0;
+            shared_ptr<MerkleTree> tree;
 
-            compute_piece_and_file_sha1(path, piece_hash, file_hash, fsz);
-            if(piece_hash.empty()) { cout << "file read error" << endl; continue; }
+            hash_for_share(path, merkle_uploads, piece_hash, file_hash, fsz, tree);
+            if(!fsz) { cout << "file read error" << endl; continue; }
+            hash_cache.save();
 
             string fname = path.substr(path.find_last_of("/\\") + 1);
-            string peer = "127.0.0.1:" + to_string(peer_port);
+            string peer = my_peer_addr();
 
             {
                 lock_guard<mutex> g_uf(uploaded_mtx);
+                // a re-upload of a changed file must stop serving its old content
+                uploaded_files.erase(fname);
+                unshare_content(path);
                 uploaded_files[fname] = path;
+                shared_content[file_hash] = path;
+                share_table[g + " " + fname] = Share{path, file_hash, tree != nullptr};
+                if(tree) merkle_trees[file_hash] = tree;
             }
+            save_shares();
 
             string msg = "UPLOAD_META " + g + " " + fname + " " + to_string(fsz) + " " + to_string(piece_hash.size()) + " " + file_hash + " " + peer + " " + current_user;
             for(auto& ph : piece_hash) msg += " " + ph;
@@ -565,93 +2498,100 @@ int main(int argc, char **argv) {
                 cout << "All trackers unreachable" << endl;
             }
         }
-        else if(cmd == "download_file") {
+        else if(cmd == "download_file" || cmd == "download_range") {
             if(current_user.empty()) { cout << "login required" << endl; continue; }
 
+            // download_range <group> <file> <offset> <length> <dest> [&]
             string g, fname, dest;
-            if(!parse_download_cmd(line, g, fname, dest)) {
-                cout << "Usage: download_file <group> <filename> <destination>" << endl;
-                continue;
+            uint64_t from = 0, len = 0;
+            auto args = split_ws(line.substr(0, line.find_last_of('&')));
+            bool ranged = cmd == "download_range";
+            char *end1 = nullptr, *end2 = nullptr;
+            if(ranged ? args.size() != 6 : args.size() != 4) {
+                args.clear();
+            } else if(ranged) {
+                from = strtoull(args[3].c_str(), &end1, 10);
+                len = strtoull(args[4].c_str(), &end2, 10);
+                if(*end1 || *end2 || !len) args.clear();
+                else args.erase(args.begin() + 3, args.begin() + 5);
             }
-
-            if(!tracker_roundtrip("GET_FILE_PEERS " + g + " " + fname + " " + current_user, rep)) {
-                cout << "All trackers unreachable" << endl;
+            if(args.size() != 4) {
+                cout << (ranged ? "Usage: download_range <group> <filename> <offset> <length> <destination>"
+                                : "Usage: download_file <group> <filename> <destination>") << endl;
                 continue;
             }
+            g = args[1]; fname = args[2]; dest = args[3];
 
-            if(rep.rfind("ERR", 0) == 0) { cout << rep << endl; continue; }
+            auto ds = prepare_file_download(g, fname, dest, from, len);
+            if(!ds) continue;
 
-            istringstream iss(rep);
-            uint64_t fsz;
-            int np;
-            iss >> fsz >> np;
-
-            string tmp;
-            getline(iss, tmp);
-            string file_sha;
-            getline(iss, file_sha);
-            string piece_line;
-            getline(iss, piece_line);
-
-            vector<string> hashes = parse_hashes(piece_line);
-            if((int)hashes.size() != np) {
-                cout << "Error: hash count mismatch" << endl;
-                continue;
-            }
-
-            string pline;
-            while(getline(iss, pline) && pline != "PEERS");
-
-            vector<string> peers;
-            while(getline(iss, pline) && !pline.empty()) {
-                peers.push_back(pline);
-            }
-
-            if(peers.empty()) { cout << "No peers available" << endl; continue; }
-
-            struct stat st;
-            string outpath = dest;
-            if(stat(dest.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
-                outpath = dest + "/" + fname;
+            if(line.find('&') != string::npos) {
+                thread(run_download_job, ds).detach();
+            } else {
+                run_download_job(ds);
             }
+        }
+        else if(cmd == "upload_dir" && tokens.size() == 3) {
+            if(current_user.empty()) { cout << "login required" << endl; continue; }
+            upload_dir(tokens[1], tokens[2]);
+        }
+        else if(cmd == "download_dir") {
+            if(current_user.empty()) { cout << "login required" << endl; continue; }
 
-            int out_fd = open(outpath.c_str(), O_CREAT | O_RDWR, 0644);
-            if(out_fd < 0) { cout << "cannot create " << dest << endl; continue; }
-
-            if(ftruncate(out_fd, fsz) != 0) {
-                cout << "cannot set file size" << endl;
-                close(out_fd);
+            string g, dir, dest;
+            if(!parse_download_cmd(line, "download_dir", g, dir, dest)) {
+                cout << "Usage: download_dir <group> <dir> <destination>" << endl;
                 continue;
             }
-            close(out_fd);
-
-            bool background = line.find('&') != string::npos;
+            auto ds = prepare_dir_download(g, dir, dest);
+            if(!ds) continue;
 
-            if(background) {
-                thread(run_download_job, g, fname, outpath, hashes, peers, fsz, file_sha).detach();
+            if(line.find('&') != string::npos) {
+                thread(run_download_job, ds).detach();
             } else {
-                run_download_job(g, fname, outpath, hashes, peers, fsz, file_sha);
+                run_download_job(ds);
             }
         }
         else if(cmd == "show_downloads") {
             print_downloads();
         }
+        else if(cmd == "show_stats") {
+            print_pipeline_stats();
+        }
+        else if(cmd == "show_trackers") {
+            print_trackers();
+        }
         else if(cmd == "stop_share" && tokens.size() == 3) {
             if(current_user.empty()) { cout << "login required" << endl; continue; }
 
-            string peer = "127.0.0.1:" + to_string(peer_port);
+            string peer = my_peer_addr();
             if(tracker_roundtrip("STOP_SHARE " + tokens[1] + " " + tokens[2] + " " + peer, rep)) {
                 cout << rep << endl;
-                lock_guard<mutex> g_uf(uploaded_mtx);
-                uploaded_files.erase(tokens[2]);
+                {
+                    lock_guard<mutex> g_uf(uploaded_mtx);
+                    share_table.erase(tokens[1] + " " + tokens[2]);
+                    auto it = uploaded_files.find(tokens[2]);
+                    if(it != uploaded_files.end()) {
+                        string path = it->second;
+                        uploaded_files.erase(it);
+                        unshare_content(path);
+                    }
+                }
+                save_shares();
             } else {
                 cout << "All trackers unreachable" << endl;
             }
         }
         else if(cmd == "logout") {
             current_user.clear();
-            lock_guard<mutex> g_uf(uploaded_mtx);
-            uploaded_files.clear();
+            {
+                lock_guard<mutex> g_uf(uploaded_mtx);
+                uploaded_files.clear();
+                shared_content.clear();
+                merkle_trees.clear();
+                share_table.clear();
+            }
+            save_shares();
             cout << "OK" << endl;
         }
         else if(cmd == "quit") {
@@ -0,0 +1,24 @@
+#include "bufpool.h"
+
+BufferPool::BufferPool(size_t buf_size, size_t max_cached)
+    : buf_size_(buf_size), free_(max_cached), requests_(0), allocs_(0), frees_(0) {}
+
+BufferPool::~BufferPool() {
+    uint8_t *buf;
+    while(free_.pop(buf)) delete[] buf;
+}
+
+uint8_t* BufferPool::acquire() {
+    requests_++;
+    uint8_t *buf;
+    if(free_.pop(buf)) return buf;
+    allocs_++;
+    return new uint8_t[buf_size_];
+}
+
+void BufferPool::release(uint8_t *buf) {
+    if(!buf) return;
+    if(free_.push(buf)) return;
+    frees_++;
+    delete[] buf;
+}
@@ -0,0 +1,50 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "mpmc_queue.h"
+
+// Fixed-size buffer pool shared by the peer server, the download pipeline and
+// the hasher. Released buffers go back on a lock-free free list (up to
+// max_cached of them) so steady-state transfers do no heap allocation.
+class BufferPool {
+public:
+    BufferPool(size_t buf_size, size_t max_cached);
+    ~BufferPool();
+
+    uint8_t* acquire();
+    void release(uint8_t *buf);
+    size_t buf_size() const { return buf_size_; }
+
+    // acquire() calls vs. heap allocations actually made
+    uint64_t requests() const { return requests_.load(); }
+    uint64_t allocs() const { return allocs_.load(); }
+    uint64_t frees() const { return frees_.load(); }
+
+private:
+    size_t buf_size_;
+    MpmcQueue<uint8_t*> free_;
+    std::atomic<uint64_t> requests_, allocs_, frees_;
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+};
+
+// RAII handle for one pooled buffer
+class PooledBuf {
+public:
+    explicit PooledBuf(BufferPool &pool) : pool_(&pool), buf_(pool.acquire()) {}
+    ~PooledBuf() { if(buf_) pool_->release(buf_); }
+    uint8_t* get() const { return buf_; }
+
+private:
+    BufferPool *pool_;
+    uint8_t *buf_;
+
+    PooledBuf(const PooledBuf&);
+    PooledBuf& operator=(const PooledBuf&);
+};
+
+#endif
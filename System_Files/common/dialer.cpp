@@ -0,0 +1,114 @@
+#include "dialer.h"
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static bool parse_addr(const std::string &addr, sockaddr_in &sa) {
+    size_t p = addr.find(':');
+    if(p == std::string::npos) return false;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)atoi(addr.c_str() + p + 1));
+    return inet_pton(AF_INET, addr.substr(0, p).c_str(), &sa.sin_addr) == 1;
+}
+
+// non-blocking socket with connect() already issued; -1 if it failed outright
+static int start_connect(const std::string &addr, bool &done) {
+    sockaddr_in sa;
+    if(!parse_addr(addr, sa)) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    int r = connect(fd, (sockaddr*)&sa, sizeof(sa));
+    if(r < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    done = r == 0;
+    return fd;
+}
+
+static void make_blocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+int dial(const std::string &addr, int timeout_ms) {
+    std::vector<std::string> one(1, addr);
+    int winner;
+    return dial_race(one, timeout_ms, &winner);
+}
+
+int dial_race(const std::vector<std::string> &addrs, int timeout_ms, int *winner,
+              std::vector<DialResult> *results) {
+    size_t n = addrs.size();
+    std::vector<DialResult> res(n, DIAL_CANCELLED);
+    std::vector<pollfd> pfds;
+    std::vector<size_t> owner; // pfds[i] belongs to addrs[owner[i]]
+    int won = -1, won_fd = -1;
+
+    for(size_t i = 0; i < n && won < 0; i++) {
+        bool done = false;
+        int fd = start_connect(addrs[i], done);
+        if(fd < 0) {
+            res[i] = DIAL_FAILED;
+            continue;
+        }
+        if(done) {
+            won = (int)i;
+            won_fd = fd;
+            break;
+        }
+        pollfd p;
+        p.fd = fd;
+        p.events = POLLOUT;
+        p.revents = 0;
+        pfds.push_back(p);
+        owner.push_back(i);
+        res[i] = DIAL_TIMEOUT;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    size_t pending = pfds.size();
+    while(won < 0 && pending > 0) {
+        long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if(left <= 0) break;
+        int r = poll(pfds.data(), pfds.size(), (int)left);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+
+        for(size_t k = 0; k < pfds.size() && won < 0; k++) {
+            if(pfds[k].fd < 0 || !pfds[k].revents) continue;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pfds[k].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err == 0 && !(pfds[k].revents & (POLLERR | POLLHUP))) {
+                won = (int)owner[k];
+                won_fd = pfds[k].fd;
+            } else {
+                res[owner[k]] = DIAL_FAILED;
+                close(pfds[k].fd);
+            }
+            pfds[k].fd = -1; // poll skips negative fds
+            pending--;
+        }
+    }
+
+    for(size_t k = 0; k < pfds.size(); k++) {
+        if(pfds[k].fd < 0) continue;
+        close(pfds[k].fd);
+        if(won >= 0) res[owner[k]] = DIAL_CANCELLED; // otherwise left as DIAL_TIMEOUT
+    }
+    if(won >= 0) {
+        res[won] = DIAL_WON;
+        make_blocking(won_fd);
+    }
+    if(winner) *winner = won;
+    if(results) results->swap(res);
+    return won_fd;
+}
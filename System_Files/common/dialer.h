@@ -0,0 +1,26 @@
+#ifndef DIALER_H
+#define DIALER_H
+
+#include <string>
+#include <vector>
+
+// Outcome of one candidate in a dial_race.
+enum DialResult {
+    DIAL_WON,       // connected first; its fd was returned
+    DIAL_FAILED,    // refused, unreachable or bad address
+    DIAL_TIMEOUT,   // still pending when the deadline passed
+    DIAL_CANCELLED  // still pending when another candidate won
+};
+
+// Connect to "ip:port" with a deadline instead of the kernel's SYN timeout.
+// Returns a blocking socket, or -1.
+int dial(const std::string &addr, int timeout_ms);
+
+// Start non-blocking connects to every candidate at once and keep the first
+// that completes; the rest are closed. Returns its fd (blocking mode) and
+// sets *winner to its index, or returns -1 if none connected within
+// timeout_ms. results, if given, receives one DialResult per candidate.
+int dial_race(const std::vector<std::string> &addrs, int timeout_ms, int *winner,
+              std::vector<DialResult> *results = nullptr);
+
+#endif
@@ -0,0 +1,222 @@
+#include "diskio.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+#ifdef P2P_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+bool pwrite_all(int fd, const void *buf, size_t len, uint64_t off) {
+    const uint8_t *cursor = (const uint8_t*)buf;
+    while(len > 0) {
+        ssize_t wrote = pwrite(fd, cursor, len, (off_t)off);
+        if(wrote <= 0) {
+            if(wrote < 0 && errno == EINTR) continue;
+            return false;
+        }
+        cursor += wrote;
+        off += (uint64_t)wrote;
+        len -= (size_t)wrote;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *cursor = (const uint8_t*)buf;
+    while(len > 0) {
+        ssize_t wrote = write(fd, cursor, len);
+        if(wrote <= 0) {
+            if(wrote < 0 && errno == EINTR) continue;
+            return false;
+        }
+        cursor += wrote;
+        len -= (size_t)wrote;
+    }
+    return true;
+}
+
+#ifdef P2P_IO_URING
+
+// Minimal io_uring driven through the raw syscalls, so the build needs only
+// the kernel headers. Only IORING_OP_WRITE is used.
+struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+static const unsigned URING_ENTRIES = 64;
+
+static Uring* uring_create() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if(fd < 0) return nullptr;
+
+    Uring *r = new Uring();
+    r->fd = fd;
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single) r->sq_len = r->cq_len = std::max(r->sq_len, r->cq_len);
+
+    r->sq_ptr = mmap(nullptr, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED) { close(fd); delete r; return nullptr; }
+    r->cq_ptr = single ? r->sq_ptr
+                       : mmap(nullptr, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    r->sqes = (io_uring_sqe*)mmap(nullptr, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_len);
+        if(!single && r->cq_ptr != MAP_FAILED) munmap(r->cq_ptr, r->cq_len);
+        close(fd); delete r; return nullptr;
+    }
+
+    uint8_t *sq = (uint8_t*)r->sq_ptr, *cq = (uint8_t*)r->cq_ptr;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
+
+static void uring_destroy(Uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if(r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    delete r;
+}
+
+#endif
+
+PieceFile::PieceFile() : fd_(-1), ring_(nullptr) {}
+
+PieceFile::~PieceFile() { close(); }
+
+bool PieceFile::open(const std::string &path, uint64_t size) {
+    close();
+    fd_ = ::open(path.c_str(), O_CREAT | O_RDWR, 0644);
+    if(fd_ < 0) return false;
+
+    // exact size first, then ask the filesystem for real extents so pieces
+    // arriving out of order do not fragment a sparse file
+    if(ftruncate(fd_, (off_t)size) != 0) { close(); return false; }
+    if(size > 0 && fallocate(fd_, 0, 0, (off_t)size) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        close();
+        return false;
+    }
+
+#ifdef P2P_IO_URING
+    ring_ = uring_create(); // stays on pwrite if the kernel refuses
+#endif
+    return true;
+}
+
+void PieceFile::close() {
+#ifdef P2P_IO_URING
+    if(ring_) uring_destroy(ring_);
+#endif
+    ring_ = nullptr;
+    pending_.clear();
+    if(fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+}
+
+bool PieceFile::write_at(const void *buf, size_t len, uint64_t off) {
+    if(fd_ < 0) return false;
+    if(!ring_) return pwrite_all(fd_, buf, len, off);
+
+    Pending w = {buf, len, off};
+    std::lock_guard<std::mutex> g(ring_mtx_);
+    return submit(&w, 1);
+}
+
+void PieceFile::queue_write(const void *buf, size_t len, uint64_t off) {
+    std::lock_guard<std::mutex> g(ring_mtx_);
+    Pending w = {buf, len, off};
+    pending_.push_back(w);
+}
+
+bool PieceFile::flush() {
+    std::lock_guard<std::mutex> g(ring_mtx_);
+    bool ok = true;
+    if(fd_ < 0) ok = pending_.empty();
+    else if(ring_) ok = submit(pending_.data(), pending_.size());
+    else for(auto &w : pending_) ok = pwrite_all(fd_, w.buf, w.len, w.off) && ok;
+    pending_.clear();
+    return ok;
+}
+
+// caller holds ring_mtx_
+bool PieceFile::submit(const Pending *w, size_t n) {
+#ifdef P2P_IO_URING
+    bool ok = true;
+    while(n > 0) {
+        unsigned batch = (unsigned)std::min<size_t>(n, ring_->entries);
+        unsigned tail = *ring_->sq_tail;
+        for(unsigned i = 0; i < batch; i++, tail++) {
+            unsigned idx = tail & *ring_->sq_mask;
+            io_uring_sqe *sqe = &ring_->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd_;
+            sqe->addr = (uint64_t)(uintptr_t)w[i].buf;
+            sqe->len = (uint32_t)w[i].len;
+            sqe->off = w[i].off;
+            sqe->user_data = i;
+            ring_->sq_array[idx] = idx;
+        }
+        __atomic_store_n(ring_->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // one syscall submits the whole batch and waits for all of it
+        unsigned done = 0;
+        int ret = (int)syscall(__NR_io_uring_enter, ring_->fd, batch, batch, IORING_ENTER_GETEVENTS, nullptr, 0);
+        while(ret < 0 && errno == EINTR) {
+            ret = (int)syscall(__NR_io_uring_enter, ring_->fd, 0, batch, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+        if(ret < 0) return false;
+
+        while(done < batch) {
+            unsigned head = *ring_->cq_head;
+            unsigned ctail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+            if(head == ctail) {
+                if(syscall(__NR_io_uring_enter, ring_->fd, 0, batch - done, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) return false;
+                continue;
+            }
+            for(; head != ctail; head++, done++) {
+                io_uring_cqe *cqe = &ring_->cqes[head & *ring_->cq_mask];
+                const Pending &p = w[cqe->user_data];
+                // finish short writes synchronously
+                if(cqe->res < 0) ok = false;
+                else if((size_t)cqe->res < p.len) {
+                    ok = pwrite_all(fd_, (const uint8_t*)p.buf + cqe->res, p.len - cqe->res, p.off + cqe->res) && ok;
+                }
+            }
+            __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+        }
+        w += batch;
+        n -= batch;
+    }
+    return ok;
+#else
+    bool ok = true;
+    for(size_t i = 0; i < n; i++) ok = pwrite_all(fd_, w[i].buf, w[i].len, w[i].off) && ok;
+    return ok;
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <sys/types.h>
+
+struct Uring;
+
+// Destination file of a download. One descriptor is opened per download and
+// shared by every worker; pieces land with positional writes so no seek or
+// reopen is needed. Built with -DP2P_IO_URING the writes go through an
+// io_uring instead, and queued writes are submitted together in one syscall.
+class PieceFile {
+public:
+    PieceFile();
+    ~PieceFile();
+
+    // create/open path and reserve size bytes (fallocate, ftruncate fallback)
+    bool open(const std::string &path, uint64_t size);
+    void close();
+
+    // write len bytes at off; safe to call from several threads
+    bool write_at(const void *buf, size_t len, uint64_t off);
+
+    // batched path: buffers must stay valid until flush() returns
+    void queue_write(const void *buf, size_t len, uint64_t off);
+    bool flush();
+
+    int fd() const { return fd_; }
+    bool uring() const { return ring_ != nullptr; }
+
+private:
+    struct Pending { const void *buf; size_t len; uint64_t off; };
+
+    bool submit(const Pending *w, size_t n);
+
+    int fd_;
+    Uring *ring_;
+    std::mutex ring_mtx_;
+    std::vector<Pending> pending_;
+
+    PieceFile(const PieceFile&);
+    PieceFile& operator=(const PieceFile&);
+};
+
+// pwrite until len bytes are written
+bool pwrite_all(int fd, const void *buf, size_t len, uint64_t off);
+// write until len bytes are written; for pipes and FIFOs
+bool write_all(int fd, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,148 @@
+#include "lz.h"
+#include <cstring>
+
+static const int HASH_LOG = 14;
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+// matches stop this far from the end so the block always ends in literals
+static const size_t LAST_LITERALS = 5;
+static const size_t MIN_INPUT = 13;
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// length of the common prefix of a and b, at most limit; compares 8 bytes at
+// a time, the first differing byte being the lowest set byte of the xor on
+// little-endian hosts
+static inline size_t common_prefix(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t n = 0;
+    for(; n + 8 <= limit; n += 8) {
+        uint64_t diff = read64(a + n) ^ read64(b + n);
+        if(diff) return n + (__builtin_ctzll(diff) >> 3);
+    }
+    while(n < limit && a[n] == b[n]) n++;
+    return n;
+}
+
+// 15 already went into the token; the rest follows as 255, 255, ..., <255
+static inline bool put_len(uint8_t *dst, size_t cap, size_t &op, size_t len) {
+    for(; len >= 255; len -= 255) {
+        if(op >= cap) return false;
+        dst[op++] = 255;
+    }
+    if(op >= cap) return false;
+    dst[op++] = (uint8_t)len;
+    return true;
+}
+
+static bool put_sequence(uint8_t *dst, size_t cap, size_t &op, const uint8_t *lit, size_t nlit,
+                         size_t offset, size_t mlen) {
+    if(op >= cap) return false;
+    size_t tok = op++;
+    dst[tok] = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if(nlit >= 15 && !put_len(dst, cap, op, nlit - 15)) return false;
+    if(cap - op < nlit) return false;
+    if(nlit) memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if(!mlen) return true; // last sequence
+
+    if(cap - op < 2) return false;
+    dst[op++] = (uint8_t)offset;
+    dst[op++] = (uint8_t)(offset >> 8);
+    size_t m = mlen - MIN_MATCH;
+    dst[tok] |= (uint8_t)(m < 15 ? m : 15);
+    return m < 15 || put_len(dst, cap, op, m - 15);
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t op = 0, anchor = 0, ip = 0;
+    if(n >= MIN_INPUT) {
+        uint32_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof(table));
+        size_t match_end = n - LAST_LITERALS, search_end = n - MIN_INPUT + 1;
+        size_t misses = 0;
+
+        while(ip < search_end) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+            if(ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                // step faster through data that keeps missing; random input
+                // is given up on after a few thousand probes
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            size_t mlen = MIN_MATCH + common_prefix(src + ref + MIN_MATCH, src + ip + MIN_MATCH,
+                                                    match_end - ip - MIN_MATCH);
+            while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+                mlen++;
+            }
+            if(!put_sequence(dst, cap, op, src + anchor, ip - anchor, ip - ref, mlen)) return 0;
+            ip += mlen;
+            anchor = ip;
+            if(ip - 2 < search_end) table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+        }
+    }
+    if(!put_sequence(dst, cap, op, src + anchor, n - anchor, 0, 0)) return 0;
+    return op;
+}
+
+static inline bool get_len(const uint8_t *src, size_t n, size_t &ip, size_t &len) {
+    uint8_t b;
+    do {
+        if(ip >= n) return false;
+        b = src[ip++];
+        len += b;
+    } while(b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+    while(ip < n) {
+        uint8_t tok = src[ip++];
+        size_t nlit = tok >> 4;
+        if(nlit == 15 && !get_len(src, n, ip, nlit)) return false;
+        if(nlit > n - ip || nlit > out_len - op) return false;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if(ip == n) break; // last sequence
+
+        if(n - ip < 2) return false;
+        size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = tok & 15;
+        if(mlen == 15 && !get_len(src, n, ip, mlen)) return false;
+        mlen += MIN_MATCH;
+        if(offset == 0 || offset > op || mlen > out_len - op) return false;
+
+        const uint8_t *from = dst + op - offset;
+        if(offset >= mlen) {
+            memcpy(dst + op, from, mlen);
+        } else {
+            // overlapping copy repeats the last `offset` bytes
+            for(size_t i = 0; i < mlen; i++) dst[op + i] = from[i];
+        }
+        op += mlen;
+    }
+    return op == out_len;
+}
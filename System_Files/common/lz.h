@@ -0,0 +1,28 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Small LZ77 block codec for piece transfers, in the spirit of LZ4: greedy
+// matching through a 16K-entry hash of 4-byte sequences, 64 KiB window, no
+// entropy stage. Fast enough to run per piece on the upload path.
+//
+// A block is a run of sequences:
+//   token  (high nibble: literal count, low nibble: match length - 4;
+//           15 in either means "add the following bytes until one is < 255")
+//   literals
+//   u16 LE match offset, absent in the last sequence, which is literals only
+
+// worst-case compressed size of n input bytes
+inline size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+// Compress src into dst. Returns the compressed size, or 0 if it would not
+// fit in cap; pass cap < n to give up early on incompressible input.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Decompress a whole block into exactly out_len bytes. Every length and
+// offset is bounds-checked, so a corrupt or hostile block returns false.
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t out_len);
+
+#endif
@@ -0,0 +1,76 @@
+#include "merkle.h"
+#include "sha1.h"
+#include "snapshot.h"
+#include <cstring>
+
+Digest digest_of(const uint8_t *data, size_t len) {
+    Digest d;
+    sha1(data, len, d.data());
+    return d;
+}
+
+std::string digest_hex(const Digest &d) {
+    return raw_to_hex(d.data(), d.size());
+}
+
+bool digest_from_hex(const std::string &hex, Digest &d) {
+    return hex_to_raw(hex, d.data(), d.size());
+}
+
+static Digest parent(const Digest &l, const Digest &r) {
+    uint8_t both[40];
+    memcpy(both, l.data(), 20);
+    memcpy(both + 20, r.data(), 20);
+    return digest_of(both, 40);
+}
+
+size_t merkle_level_size(size_t nleaves, int level) {
+    size_t n = nleaves;
+    for(int i = 0; i < level; i++) n = (n + 1) / 2;
+    return n;
+}
+
+Digest merkle_fold(const Digest *leaves, size_t n) {
+    std::vector<Digest> cur(leaves, leaves + n);
+    while(cur.size() > 1) {
+        size_t m = 0;
+        for(size_t i = 0; i < cur.size(); i += 2) cur[m++] = i + 1 < cur.size() ? parent(cur[i], cur[i + 1]) : cur[i];
+        cur.resize(m);
+    }
+    return cur.empty() ? Digest() : cur[0];
+}
+
+void MerkleTree::build(std::vector<Digest> leaves) {
+    levels_.clear();
+    if(leaves.empty()) leaves.push_back(digest_of(nullptr, 0));
+    levels_.push_back(std::move(leaves));
+    while(levels_.back().size() > 1) {
+        const std::vector<Digest> &below = levels_.back();
+        std::vector<Digest> up;
+        up.reserve((below.size() + 1) / 2);
+        for(size_t i = 0; i < below.size(); i += 2) up.push_back(i + 1 < below.size() ? parent(below[i], below[i + 1]) : below[i]);
+        levels_.push_back(std::move(up));
+    }
+}
+
+std::vector<Digest> MerkleTree::proof(int level, size_t index) const {
+    std::vector<Digest> out;
+    for(size_t l = (size_t)level; l + 1 < levels_.size(); l++, index >>= 1) {
+        size_t sib = index ^ 1;
+        if(sib < levels_[l].size()) out.push_back(levels_[l][sib]);
+    }
+    return out;
+}
+
+bool merkle_verify(Digest node, int level, size_t index, const Digest *uncles, size_t nuncles, size_t nleaves,
+                   const Digest &root) {
+    size_t n = merkle_level_size(nleaves, level), used = 0;
+    if(index >= n) return false;
+    for(; n > 1; n = (n + 1) / 2, index >>= 1) {
+        if((index ^ 1) >= n) continue; // promoted unchanged
+        if(used == nuncles) return false;
+        const Digest &sib = uncles[used++];
+        node = index & 1 ? parent(sib, node) : parent(node, sib);
+    }
+    return used == nuncles && node == root;
+}
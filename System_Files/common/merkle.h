@@ -0,0 +1,50 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <array>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// SHA-1 Merkle tree over fixed-size blocks of a file. Leaves are the digests
+// of MERKLE_BLOCK-byte blocks (the last may be short); a parent is the
+// SHA-1 of its two children's raw digests, and a node without a right
+// sibling moves up unchanged. Because pairing is positional, any aligned
+// run of 2^k leaves (a piece, say) folds to exactly the tree node above it,
+// so a piece is checked with its leaves plus the uncles on its path.
+
+static const size_t MERKLE_BLOCK = 16 * 1024;
+
+typedef std::array<uint8_t, 20> Digest;
+
+Digest digest_of(const uint8_t *data, size_t len);
+std::string digest_hex(const Digest &d);
+bool digest_from_hex(const std::string &hex, Digest &d);
+
+// number of nodes at `level` (0 = leaves) in a tree of nleaves leaves
+size_t merkle_level_size(size_t nleaves, int level);
+
+// fold leaves up to a single node with the tree's pairing rule
+Digest merkle_fold(const Digest *leaves, size_t n);
+
+class MerkleTree {
+public:
+    void build(std::vector<Digest> leaves);
+    size_t leaves() const { return levels_.empty() ? 0 : levels_[0].size(); }
+    const Digest &root() const { return levels_.back()[0]; }
+    const Digest &leaf(size_t i) const { return levels_[0][i]; }
+
+    // uncles of node `index` at `level`, bottom up, skipping levels where the
+    // node has no sibling
+    std::vector<Digest> proof(int level, size_t index) const;
+
+private:
+    std::vector<std::vector<Digest>> levels_;
+};
+
+// does node (level, index) with these uncles lead to root?
+bool merkle_verify(Digest node, int level, size_t index, const Digest *uncles, size_t nuncles, size_t nleaves,
+                   const Digest &root);
+
+#endif
@@ -0,0 +1,51 @@
+#include "metrics.h"
+#include <cstdio>
+#include <limits>
+
+double histogram_bucket_le(int i) {
+    if(i >= LatencyHistogram::NBUCKETS - 1) return std::numeric_limits<double>::infinity();
+    return (double)(1ULL << i) / 1e6;
+}
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_ns_(0) {
+    for(int i = 0; i < NBUCKETS; i++) buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::record_ns(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while(b < NBUCKETS - 1 && us > (1ULL << b)) b++;
+    buckets_[b].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::quantile(double q) const {
+    uint64_t total = count();
+    if(total == 0) return 0.0;
+    uint64_t target = (uint64_t)(q * total), seen = 0;
+    for(int i = 0; i < NBUCKETS; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if(seen > target) return histogram_bucket_le(i);
+    }
+    return histogram_bucket_le(NBUCKETS - 1);
+}
+
+void LatencyHistogram::write_prometheus(std::string &out, const std::string &name, const std::string &labels) const {
+    char line[256];
+    std::string sep = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    for(int i = 0; i < NBUCKETS; i++) {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        if(i == NBUCKETS - 1) {
+            snprintf(line, sizeof(line), "%s_bucket{%sle=\"+Inf\"} %llu\n", name.c_str(), sep.c_str(), (unsigned long long)cumulative);
+        } else {
+            snprintf(line, sizeof(line), "%s_bucket{%sle=\"%g\"} %llu\n", name.c_str(), sep.c_str(), histogram_bucket_le(i), (unsigned long long)cumulative);
+        }
+        out += line;
+    }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    snprintf(line, sizeof(line), "%s_sum%s %.9f\n%s_count%s %llu\n", name.c_str(), braces.c_str(), sum_ns() / 1e9,
+             name.c_str(), braces.c_str(), (unsigned long long)count());
+    out += line;
+}
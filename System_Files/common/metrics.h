@@ -0,0 +1,33 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+// Lock-free latency histogram with power-of-two microsecond buckets
+// (1us .. ~4s, plus overflow). Recording is a couple of relaxed atomic adds.
+class LatencyHistogram {
+public:
+    static const int NBUCKETS = 24;
+
+    LatencyHistogram();
+    void record_ns(uint64_t ns);
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum_ns() const { return sum_ns_.load(std::memory_order_relaxed); }
+    // upper bound of the bucket holding quantile q (0..1), in seconds
+    double quantile(double q) const;
+
+    // Prometheus text exposition: name_bucket/_sum/_count, labels like cmd="X"
+    void write_prometheus(std::string &out, const std::string &name, const std::string &labels) const;
+
+private:
+    std::atomic<uint64_t> buckets_[NBUCKETS];
+    std::atomic<uint64_t> count_, sum_ns_;
+};
+
+// bucket upper bound in seconds (infinity for the last bucket)
+double histogram_bucket_le(int i);
+
+#endif
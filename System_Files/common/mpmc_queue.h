@@ -0,0 +1,101 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov). Capacity is
+// rounded up to a power of two; push/pop never block and return false when
+// the queue is full/empty.
+template<typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(size_t capacity) {
+        size_t cap = 2;
+        while(cap < capacity) cap <<= 1;
+        cells_ = std::vector<Cell>(cap);
+        mask_ = cap - 1;
+        for(size_t i = 0; i < cap; i++) cells_[i].seq.store(i, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    bool push(const T &v) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell &c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if(dif == 0) {
+                if(tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.val = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(dif < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T &out) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for(;;) {
+            Cell &c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(dif == 0) {
+                if(head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = c.val;
+                    c.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(dif < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // approximate number of queued items, for occupancy stats only
+    size_t size() const {
+        size_t t = tail_.load(std::memory_order_relaxed), h = head_.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T val;
+        Cell() : seq(0), val() {}
+        Cell(const Cell &o) : seq(o.seq.load()), val(o.val) {}
+    };
+
+    std::vector<Cell> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+// Wait strategy for threads polling a queue: spin briefly, then yield, then
+// sleep so idle stages do not burn a core.
+struct Backoff {
+    unsigned n;
+    Backoff() : n(0) {}
+    void pause() {
+        if(n < 16) { n++; return; }
+        if(n < 64) { n++; std::this_thread::yield(); return; }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    void reset() { n = 0; }
+};
+
+#endif
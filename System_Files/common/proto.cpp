@@ -1,6 +1,7 @@
 #include "proto.h"
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <cstring>
@@ -36,19 +37,54 @@ ssize_t recv_all(int fd, void *buf, size_t len) {
     return (ssize_t)len;
 }
 
+// Header and payload leave in one writev: two separate sends let Nagle hold
+// the payload until the peer's delayed ACK for the header (~40ms per message).
+bool send_msg_parts(int fd, std::initializer_list<const std::string*> parts) {
+    struct iovec iov[8];
+    if(parts.size() >= 8) return false;
+    uint32_t total = 0;
+    for(auto *p : parts) total += (uint32_t)p->size();
+    uint32_t n = htonl(total);
+
+    iov[0].iov_base = &n;
+    iov[0].iov_len = 4;
+    size_t cnt = 1;
+    for(auto *p : parts) {
+        if(p->empty()) continue;
+        iov[cnt].iov_base = (void*)p->data();
+        iov[cnt].iov_len = p->size();
+        cnt++;
+    }
+
+    size_t idx = 0;
+    while(idx < cnt) {
+        ssize_t wrote = writev(fd, iov + idx, (int)(cnt - idx));
+        if(wrote <= 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        while(idx < cnt && (size_t)wrote >= iov[idx].iov_len) {
+            wrote -= iov[idx].iov_len;
+            idx++;
+        }
+        if(idx < cnt) {
+            iov[idx].iov_base = (uint8_t*)iov[idx].iov_base + wrote;
+            iov[idx].iov_len -= wrote;
+        }
+    }
+    return true;
+}
+
 bool send_msg(int fd, const std::string &s) {
-    uint32_t n = htonl((uint32_t)s.size());
-    if(send_all(fd, &n, 4) != 4) return false;
-    if(s.empty()) return true;
-    return send_all(fd, s.data(), s.size()) == (ssize_t)s.size();
+    return send_msg_parts(fd, {&s});
 }
 
-bool recv_msg(int fd, std::string &out) {
+bool recv_msg(int fd, std::string &out, uint32_t max_bytes) {
     uint32_t n;
     if(recv_all(fd, &n, 4) != 4) return false;
     n = ntohl(n);
     if(n == 0) { out.clear(); return true; }
-    if(n > 2u*1024u*1024u) return false; // cap messages at 2MB
+    if(n > max_bytes) return false;
     out.resize(n);
     return recv_all(fd, &out[0], n) == (ssize_t)n;
 }
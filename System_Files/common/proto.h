@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <initializer_list>
 #include <sys/types.h>
 
 // reliable send of exactly len bytes
@@ -11,9 +12,15 @@ ssize_t send_all(int fd, const void *buf, size_t len);
 // reliable recv of exactly len bytes
 ssize_t recv_all(int fd, void *buf, size_t len);
 
-// length-prefixed message send/recv helpers
+// length-prefixed message send/recv helpers; recv_msg rejects anything over
+// max_bytes. Only directory manifests and the tracker replies carrying GET_DIR
+// listings get the bulk cap, so no other socket can make a receiver hold 64 MiB.
+static const uint32_t MAX_MSG_BYTES = 2u * 1024u * 1024u;
+static const uint32_t MAX_BULK_MSG_BYTES = 64u * 1024u * 1024u;
 bool send_msg(int fd, const std::string &s);
-bool recv_msg(int fd, std::string &out);
+bool recv_msg(int fd, std::string &out, uint32_t max_bytes = MAX_MSG_BYTES);
+// one message whose payload is the concatenation of up to 7 parts, sent without copying
+bool send_msg_parts(int fd, std::initializer_list<const std::string*> parts);
 
 // split by ASCII whitespace into tokens
 std::vector<std::string> split_ws(const std::string &s);
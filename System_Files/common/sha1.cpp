@@ -4,63 +4,67 @@
 
 static inline uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
 
-void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
-    uint32_t h0 = 0x67452301, h1 = 0xEFCDAB89, h2 = 0x98BADCFE, h3 = 0x10325476, h4 = 0xC3D2E1F0;
-    uint64_t bitlen = (uint64_t)len * 8ULL;
-    size_t padded = ((len + 9) + 63) & ~63;
-    uint8_t *buf = (uint8_t*)malloc(padded);
-    if(!buf) return;
+// compress one 64-byte block into h
+static void sha1_block(uint32_t h[5], const uint8_t *block) {
+    uint32_t w[80];
+    for(int i = 0; i < 16; i++) {
+        const uint8_t *p = block + 4 * i;
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
 
-    memset(buf, 0, padded);
-    memcpy(buf, data, len);
-    buf[len] = 0x80;
+    for(int i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
 
-    for(int i = 0; i < 8; i++) {
-        buf[padded - 1 - i] = (bitlen >> (8 * i)) & 0xFF;
-    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
 
-    for(size_t chunk = 0; chunk < padded; chunk += 64) {
-        uint32_t w[80];
-        for(int i = 0; i < 16; i++) {
-            size_t off = chunk + 4 * i;
-            w[i] = (buf[off] << 24) | (buf[off + 1] << 16) | (buf[off + 2] << 8) | (buf[off + 3]);
+    for(int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if(i < 20) {
+            f = (b & c) | ((~b) & d);
+            k = 0x5A827999;
+        } else if(i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
         }
 
-        for(int i = 16; i < 80; i++) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = rotl(b, 30); b = a; a = temp;
+    }
 
-        uint32_t a = h0, b = h1, c = h2, d = h3, e = h4;
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
 
-        for(int i = 0; i < 80; i++) {
-            uint32_t f, k;
-            if(i < 20) {
-                f = (b & c) | ((~b) & d);
-                k = 0x5A827999;
-            } else if(i < 40) {
-                f = b ^ c ^ d;
-                k = 0x6ED9EBA1;
-            } else if(i < 60) {
-                f = (b & c) | (b & d) | (c & d);
-                k = 0x8F1BBCDC;
-            } else {
-                f = b ^ c ^ d;
-                k = 0xCA62C1D6;
-            }
+void sha1(const uint8_t *data, size_t len, uint8_t out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint64_t bitlen = (uint64_t)len * 8ULL;
 
-            uint32_t temp = rotl(a, 5) + f + e + k + w[i];
-            e = d; d = c; c = rotl(b, 30); b = a; a = temp;
-        }
+    // full blocks straight from the input, only the tail is copied for padding
+    size_t full = len & ~(size_t)63;
+    for(size_t chunk = 0; chunk < full; chunk += 64) sha1_block(h, data + chunk);
 
-        h0 += a; h1 += b; h2 += c; h3 += d; h4 += e;
+    uint8_t tail[128];
+    size_t rest = len - full;
+    size_t padded = rest + 9 > 64 ? 128 : 64;
+    memset(tail, 0, padded);
+    if(rest) memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+
+    for(int i = 0; i < 8; i++) {
+        tail[padded - 1 - i] = (bitlen >> (8 * i)) & 0xFF;
     }
 
-    free(buf);
-    uint32_t hs[5] = {h0, h1, h2, h3, h4};
+    for(size_t chunk = 0; chunk < padded; chunk += 64) sha1_block(h, tail + chunk);
 
     for(int i = 0; i < 5; i++) {
-        out[4 * i + 0] = (hs[i] >> 24) & 0xFF;
-        out[4 * i + 1] = (hs[i] >> 16) & 0xFF;
-        out[4 * i + 2] = (hs[i] >> 8) & 0xFF;
-        out[4 * i + 3] = (hs[i] >> 0) & 0xFF;
+        out[4 * i + 0] = (h[i] >> 24) & 0xFF;
+        out[4 * i + 1] = (h[i] >> 16) & 0xFF;
+        out[4 * i + 2] = (h[i] >> 8) & 0xFF;
+        out[4 * i + 3] = (h[i] >> 0) & 0xFF;
     }
 }
 
@@ -74,4 +78,4 @@ void sha1_hex(const uint8_t *data, size_t len, char outhex[41]) {
         outhex[2 * i + 1] = hex[out[i] & 0xF];
     }
     outhex[40] = '\0';
-}
\ No newline at end of file
+}
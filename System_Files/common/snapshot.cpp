@@ -0,0 +1,170 @@
+#include "snapshot.h"
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SNAP_MAGIC[8] = {'P', '2', 'P', 'S', 'N', 'A', 'P', '1'};
+static const size_t SNAP_HDR = 32;
+
+uint64_t fnv1a64(const uint8_t *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// table lookup: digests are random, so a chain of range checks mispredicts
+struct HexTable {
+    int8_t v[256];
+    HexTable() {
+        memset(v, -1, sizeof(v));
+        for(int c = '0'; c <= '9'; c++) v[c] = (int8_t)(c - '0');
+        for(int c = 'a'; c <= 'f'; c++) v[c] = v[c - 'a' + 'A'] = (int8_t)(c - 'a' + 10);
+    }
+};
+static const HexTable hex_table;
+
+static int hexval(char c) {
+    return hex_table.v[(uint8_t)c];
+}
+
+bool hex_to_raw(const std::string &hex, uint8_t *out, size_t n) {
+    if(hex.size() != 2 * n) return false;
+    for(size_t i = 0; i < n; i++) {
+        int hi = hexval(hex[2 * i]), lo = hexval(hex[2 * i + 1]);
+        if(hi < 0 || lo < 0) return false;
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+std::string raw_to_hex(const uint8_t *raw, size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(2 * n, '0');
+    for(size_t i = 0; i < n; i++) {
+        s[2 * i] = digits[raw[i] >> 4];
+        s[2 * i + 1] = digits[raw[i] & 0xF];
+    }
+    return s;
+}
+
+static void put_le(std::string &b, uint64_t v, int nbytes) {
+    for(int i = 0; i < nbytes; i++) b.push_back((char)(v >> (8 * i)));
+}
+
+static uint64_t get_le(const uint8_t *p, int nbytes) {
+    uint64_t v = 0;
+    for(int i = nbytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+void SnapWriter::u32(uint32_t v) { put_le(buf_, v, 4); }
+void SnapWriter::u64(uint64_t v) { put_le(buf_, v, 8); }
+
+void SnapWriter::str(const std::string &s) {
+    u32((uint32_t)s.size());
+    buf_.append(s);
+}
+
+void SnapWriter::raw(const void *p, size_t n) {
+    buf_.append((const char*)p, n);
+}
+
+bool SnapWriter::commit(const std::string &path) {
+    std::string hdr(SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    put_le(hdr, SNAP_VERSION, 4);
+    put_le(hdr, 0, 4);
+    put_le(hdr, buf_.size(), 8);
+    put_le(hdr, fnv1a64((const uint8_t*)buf_.data(), buf_.size()), 8);
+
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f) return false;
+    bool ok = fwrite(hdr.data(), 1, hdr.size(), f) == hdr.size() &&
+              fwrite(buf_.data(), 1, buf_.size(), f) == buf_.size();
+    ok = fclose(f) == 0 && ok;
+    // rename keeps readers of the old snapshot (including live mappings) intact
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+SnapReader::SnapReader() : map_(nullptr), map_len_(0), data_(nullptr), len_(0), pos_(0), version_(0) {}
+
+SnapReader::~SnapReader() { close(); }
+
+bool SnapReader::open(const std::string &path, std::string *err) {
+    close();
+    auto fail = [&](const char *why) {
+        if(err) *err = why;
+        close();
+        return false;
+    };
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return fail("missing");
+    struct stat st;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < SNAP_HDR) {
+        ::close(fd);
+        return fail("truncated header");
+    }
+    map_len_ = (size_t)st.st_size;
+    map_ = mmap(nullptr, map_len_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if(map_ == MAP_FAILED) {
+        map_ = nullptr;
+        return fail("mmap failed");
+    }
+
+    const uint8_t *base = (const uint8_t*)map_;
+    if(memcmp(base, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0) return fail("bad magic");
+    version_ = (uint32_t)get_le(base + 8, 4);
+    if(version_ < SNAP_MIN_VERSION || version_ > SNAP_VERSION) return fail("unsupported version");
+    uint64_t plen = get_le(base + 16, 8);
+    if(plen != map_len_ - SNAP_HDR) return fail("length mismatch");
+    data_ = base + SNAP_HDR;
+    len_ = (size_t)plen;
+    if(fnv1a64(data_, len_) != get_le(base + 24, 8)) return fail("checksum mismatch");
+    pos_ = 0;
+    return true;
+}
+
+void SnapReader::close() {
+    if(map_) munmap(map_, map_len_);
+    map_ = nullptr;
+    map_len_ = 0;
+    data_ = nullptr;
+    len_ = pos_ = 0;
+}
+
+bool SnapReader::u32(uint32_t &v) {
+    if(len_ - pos_ < 4) return false;
+    v = (uint32_t)get_le(data_ + pos_, 4);
+    pos_ += 4;
+    return true;
+}
+
+bool SnapReader::u64(uint64_t &v) {
+    if(len_ - pos_ < 8) return false;
+    v = get_le(data_ + pos_, 8);
+    pos_ += 8;
+    return true;
+}
+
+bool SnapReader::str(std::string &s) {
+    uint32_t n;
+    if(!u32(n) || len_ - pos_ < n) return false;
+    s.assign((const char*)data_ + pos_, n);
+    pos_ += n;
+    return true;
+}
+
+bool SnapReader::raw(const uint8_t *&p, size_t n) {
+    if(len_ - pos_ < n) return false;
+    p = data_ + pos_;
+    pos_ += n;
+    return true;
+}
@@ -0,0 +1,74 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Binary snapshot container. Layout (little-endian):
+//
+//   "P2PSNAP1"  u32 version  u32 reserved  u64 payload_len  u64 fnv1a64(payload)
+//   payload...
+//
+// The payload is a flat sequence of u32/u64 integers, u32-length-prefixed
+// strings and raw byte runs; what it means is up to the caller. Readers map
+// the file and decode in place, so raw runs can be referenced without copying
+// for as long as the SnapReader stays open.
+
+static const uint32_t SNAP_VERSION = 2;
+static const uint32_t SNAP_MIN_VERSION = 1; // oldest layout readers still accept
+
+uint64_t fnv1a64(const uint8_t *data, size_t len);
+
+// hex digest <-> raw bytes; hex_to_raw rejects anything but 2*n hex digits
+bool hex_to_raw(const std::string &hex, uint8_t *out, size_t n);
+std::string raw_to_hex(const uint8_t *raw, size_t n);
+
+class SnapWriter {
+public:
+    void u32(uint32_t v);
+    void u64(uint64_t v);
+    void str(const std::string &s);
+    void raw(const void *p, size_t n);
+
+    // write header + payload to path.tmp, then rename it over path
+    bool commit(const std::string &path);
+
+    size_t size() const { return buf_.size(); }
+
+private:
+    std::string buf_;
+};
+
+class SnapReader {
+public:
+    SnapReader();
+    ~SnapReader();
+
+    // map path and validate magic, version, length and checksum
+    bool open(const std::string &path, std::string *err = nullptr);
+    void close();
+
+    // cursor getters; false once the payload is exhausted or malformed
+    bool u32(uint32_t &v);
+    bool u64(uint64_t &v);
+    bool str(std::string &s);
+    // pointer to n bytes inside the mapping, valid until close()
+    bool raw(const uint8_t *&p, size_t n);
+
+    bool at_end() const { return pos_ == len_; }
+    uint32_t version() const { return version_; }
+    size_t mapped_bytes() const { return map_len_; }
+
+private:
+    void *map_;
+    size_t map_len_;
+    const uint8_t *data_;
+    size_t len_, pos_;
+    uint32_t version_;
+
+    SnapReader(const SnapReader&);
+    SnapReader& operator=(const SnapReader&);
+};
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <cstdio>
+
+// Shared by the tests/*_test.cpp programs. CHECK records a failure with its
+// location and keeps going; main returns test_summary(), which prints the
+// outcome and gives the exit status `make test` looks at.
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if(!(cond)) { failures++; fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+                  fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } \
+} while(0)
+
+static int test_summary(const char *name) {
+    if(failures) {
+        printf("%s: %d FAILED\n", name, failures);
+        return 1;
+    }
+    printf("%s: all passed\n", name);
+    return 0;
+}
+
+#endif
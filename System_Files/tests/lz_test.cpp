@@ -0,0 +1,116 @@
+// Round-trip tests for common/lz: every length up to a few pieces' worth of
+// edge cases over text-like, repetitive and random data, early give-up on
+// incompressible input, and corrupted blocks being rejected without
+// touching memory outside the output buffer.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../common/lz.h"
+#include "check.h"
+
+using namespace std;
+
+static uint64_t rng = 0x243F6A8885A308D3ULL;
+static uint64_t next_rand() {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+static vector<uint8_t> text_like(size_t n) {
+    static const char *words[] = {"GET", "/api/v1/files", "200", "404", "peer", "piece", "2026-10-18T12:00:00Z",
+                                  "upload", "download", "group", "tracker", ",", " ", "\n"};
+    vector<uint8_t> v;
+    while(v.size() < n) {
+        const char *w = words[next_rand() % (sizeof(words) / sizeof(words[0]))];
+        v.insert(v.end(), w, w + strlen(w));
+    }
+    v.resize(n);
+    return v;
+}
+
+static vector<uint8_t> random_bytes(size_t n) {
+    vector<uint8_t> v(n);
+    for(auto& b : v) b = (uint8_t)next_rand();
+    return v;
+}
+
+static vector<uint8_t> runs(size_t n) {
+    vector<uint8_t> v;
+    while(v.size() < n) v.insert(v.end(), 1 + next_rand() % 600, (uint8_t)(next_rand() % 3));
+    v.resize(n);
+    return v;
+}
+
+static bool round_trip(const vector<uint8_t>& in, size_t *csize = nullptr) {
+    vector<uint8_t> c(lz_bound(in.size())), out(in.size() + 1, 0xAA);
+    size_t cn = lz_compress(in.data(), in.size(), c.data(), c.size());
+    if(csize) *csize = cn;
+    if(cn == 0) return false;
+    // the guard byte past out_len must survive
+    return lz_decompress(c.data(), cn, out.data(), in.size()) && equal(in.begin(), in.end(), out.begin()) &&
+           out[in.size()] == 0xAA;
+}
+
+static void test_round_trips() {
+    int checked = 0;
+    for(size_t n = 0; n <= 300; n++) {
+        CHECK(round_trip(text_like(n)), "text len=%zu", n);
+        CHECK(round_trip(random_bytes(n)), "random len=%zu", n);
+        CHECK(round_trip(runs(n)), "runs len=%zu", n);
+        checked += 3;
+    }
+    for(size_t n : {4095, 4096, 65535, 65536, 65537, 131072, 524287, 524288}) {
+        size_t cn;
+        CHECK(round_trip(text_like(n), &cn), "text len=%zu", n);
+        CHECK(cn < n / 2, "text len=%zu only compressed to %zu", n, cn);
+        CHECK(round_trip(random_bytes(n)), "random len=%zu", n);
+        CHECK(round_trip(runs(n), &cn), "runs len=%zu", n);
+        CHECK(cn < n / 20, "runs len=%zu only compressed to %zu", n, cn);
+        CHECK(round_trip(vector<uint8_t>(n, 'z')), "constant len=%zu", n);
+        checked += 4;
+    }
+    printf("lz_test: %d round trips\n", checked);
+}
+
+static void test_give_up() {
+    vector<uint8_t> in = random_bytes(524288), c(in.size());
+    CHECK(lz_compress(in.data(), in.size(), c.data(), in.size() - in.size() / 8) == 0,
+          "random piece should not fit in 7/8 of its size");
+    CHECK(lz_compress(in.data(), in.size(), c.data(), 0) == 0, "zero capacity");
+}
+
+static void test_corruption() {
+    vector<uint8_t> in = text_like(65536), c(lz_bound(in.size())), out(in.size() + 64);
+    size_t cn = lz_compress(in.data(), in.size(), c.data(), c.size());
+    CHECK(cn > 0, "compress");
+
+    // wrong lengths are caught by the exact-size check
+    CHECK(!lz_decompress(c.data(), cn, out.data(), in.size() - 1), "short output buffer accepted");
+    CHECK(!lz_decompress(c.data(), cn - 1, out.data(), in.size()), "truncated block accepted");
+
+    // random byte flips must fail or decode to in.size() bytes, never overrun
+    int rejected = 0;
+    for(int i = 0; i < 2000; i++) {
+        vector<uint8_t> bad(c.begin(), c.begin() + cn);
+        for(int k = 0; k < 3; k++) bad[next_rand() % cn] = (uint8_t)next_rand();
+        memset(out.data() + in.size(), 0x5C, 64);
+        if(!lz_decompress(bad.data(), bad.size(), out.data(), in.size())) rejected++;
+        bool guard = true;
+        for(int k = 0; k < 64; k++) guard = guard && out[in.size() + k] == 0x5C;
+        CHECK(guard, "corrupt block %d wrote past the output", i);
+    }
+    printf("lz_test: %d/2000 corrupted blocks rejected\n", rejected);
+
+    vector<uint8_t> junk = random_bytes(4096);
+    lz_decompress(junk.data(), junk.size(), out.data(), in.size());
+}
+
+int main() {
+    test_round_trips();
+    test_give_up();
+    test_corruption();
+    return test_summary("lz_test");
+}
@@ -0,0 +1,105 @@
+// Tests for common/merkle: piece-aligned subtrees fold to the tree node the
+// proofs start from, every piece's proof checks out for a range of leaf
+// counts (including odd tails that get promoted), and tampered leaves,
+// uncles, indices or leaf counts are rejected.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "../common/merkle.h"
+#include "check.h"
+
+using namespace std;
+
+static const int PIECE_LEVEL = 5; // 32 leaves of 16 KiB = one 512 KiB piece
+
+static vector<Digest> make_leaves(size_t n) {
+    vector<Digest> v(n);
+    for(size_t i = 0; i < n; i++) {
+        uint8_t seed[8];
+        memcpy(seed, &i, sizeof(seed));
+        v[i] = digest_of(seed, sizeof(seed));
+    }
+    return v;
+}
+
+static void test_known_values() {
+    // one leaf is its own root; two leaves hash together; a third is promoted
+    vector<Digest> l = make_leaves(3);
+    MerkleTree t;
+    t.build(vector<Digest>(l.begin(), l.begin() + 1));
+    CHECK(t.root() == l[0], "single leaf root");
+
+    uint8_t both[40];
+    memcpy(both, l[0].data(), 20);
+    memcpy(both + 20, l[1].data(), 20);
+    Digest ab = digest_of(both, 40);
+    t.build(vector<Digest>(l.begin(), l.begin() + 2));
+    CHECK(t.root() == ab, "two leaf root");
+
+    memcpy(both, ab.data(), 20);
+    memcpy(both + 20, l[2].data(), 20);
+    t.build(l);
+    CHECK(t.root() == digest_of(both, 40), "three leaf root");
+
+    Digest d;
+    CHECK(digest_from_hex(digest_hex(ab), d) && d == ab, "hex round trip");
+    CHECK(!digest_from_hex("xyz", d), "bad hex accepted");
+}
+
+static void test_piece_proofs() {
+    int checked = 0;
+    for(size_t n : {1, 2, 3, 31, 32, 33, 63, 64, 65, 100, 257, 1000, 4096, 4097}) {
+        vector<Digest> leaves = make_leaves(n);
+        MerkleTree t;
+        t.build(leaves);
+        CHECK(t.root() == merkle_fold(leaves.data(), n), "fold != build for n=%zu", n);
+
+        size_t npieces = (n + 31) / 32;
+        CHECK(merkle_level_size(n, PIECE_LEVEL) == npieces, "level size n=%zu", n);
+        for(size_t p = 0; p < npieces; p++) {
+            size_t first = p * 32, cnt = min<size_t>(32, n - first);
+            Digest node = merkle_fold(leaves.data() + first, cnt);
+            vector<Digest> pr = t.proof(PIECE_LEVEL, p);
+            CHECK(merkle_verify(node, PIECE_LEVEL, p, pr.data(), pr.size(), n, t.root()), "n=%zu piece=%zu", n, p);
+            checked++;
+
+            if(!pr.empty()) {
+                vector<Digest> bad = pr;
+                bad[0][3] ^= 1;
+                CHECK(!merkle_verify(node, PIECE_LEVEL, p, bad.data(), bad.size(), n, t.root()),
+                      "tampered uncle accepted n=%zu piece=%zu", n, p);
+                CHECK(!merkle_verify(node, PIECE_LEVEL, p, pr.data(), pr.size() - 1, n, t.root()),
+                      "short proof accepted n=%zu piece=%zu", n, p);
+            }
+            Digest flipped = node;
+            flipped[0] ^= 0x80;
+            CHECK(!merkle_verify(flipped, PIECE_LEVEL, p, pr.data(), pr.size(), n, t.root()),
+                  "tampered piece accepted n=%zu piece=%zu", n, p);
+            if(npieces > 1)
+                CHECK(!merkle_verify(node, PIECE_LEVEL, (p + 1) % npieces, pr.data(), pr.size(), n, t.root()),
+                      "wrong index accepted n=%zu piece=%zu", n, p);
+        }
+        CHECK(!merkle_verify(t.root(), PIECE_LEVEL, npieces, nullptr, 0, n, t.root()), "index past end n=%zu", n);
+    }
+
+    // leaf-level proofs too
+    vector<Digest> leaves = make_leaves(77);
+    MerkleTree t;
+    t.build(leaves);
+    for(size_t i = 0; i < leaves.size(); i++) {
+        vector<Digest> pr = t.proof(0, i);
+        CHECK(merkle_verify(leaves[i], 0, i, pr.data(), pr.size(), leaves.size(), t.root()), "leaf %zu", i);
+        checked++;
+    }
+    // the promoted tail leaf gains a sibling if the count is off by one
+    vector<Digest> pr = t.proof(0, 76);
+    CHECK(!merkle_verify(leaves[76], 0, 76, pr.data(), pr.size(), 78, t.root()), "wrong leaf count accepted");
+    printf("merkle_test: %d proofs verified\n", checked);
+}
+
+int main() {
+    test_known_values();
+    test_piece_proofs();
+    return test_summary("merkle_test");
+}
@@ -0,0 +1,111 @@
+// Conformance tests for common/sha1: published vectors plus a comparison
+// against a straightforward byte-at-a-time reference across many lengths,
+// concentrated around the 55/56/64-byte padding boundaries.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../common/sha1.h"
+#include "check.h"
+
+using namespace std;
+
+// Textbook SHA-1 (FIPS 180-4 6.1.2): pad the whole message into a copy,
+// then compress block by block. Slow and obvious on purpose.
+static string ref_sha1_hex(const uint8_t *data, size_t len) {
+    vector<uint8_t> m(data, data + len);
+    m.push_back(0x80);
+    while(m.size() % 64 != 56) m.push_back(0);
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i = 7; i >= 0; i--) m.push_back((uint8_t)(bits >> (8 * i)));
+
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    auto rol = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    for(size_t b = 0; b < m.size(); b += 64) {
+        uint32_t w[80];
+        for(int t = 0; t < 16; t++) {
+            w[t] = 0;
+            for(int k = 0; k < 4; k++) w[t] = (w[t] << 8) | m[b + 4 * t + k];
+        }
+        for(int t = 16; t < 80; t++) w[t] = rol(w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16], 1);
+        uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+        for(int t = 0; t < 80; t++) {
+            uint32_t f, k;
+            if(t < 20)      { f = (bb & c) ^ (~bb & d);           k = 0x5A827999; }
+            else if(t < 40) { f = bb ^ c ^ d;                     k = 0x6ED9EBA1; }
+            else if(t < 60) { f = (bb & c) ^ (bb & d) ^ (c & d);  k = 0x8F1BBCDC; }
+            else            { f = bb ^ c ^ d;                     k = 0xCA62C1D6; }
+            uint32_t tmp = rol(a, 5) + f + e + k + w[t];
+            e = d; d = c; c = rol(bb, 30); bb = a; a = tmp;
+        }
+        h[0] += a; h[1] += bb; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    char hex[41];
+    for(int i = 0; i < 5; i++) snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    return hex;
+}
+
+static string hex_of(const string& s) {
+    char out[41];
+    sha1_hex((const uint8_t*)s.data(), s.size(), out);
+    return out;
+}
+
+static void test_vectors() {
+    struct { string in; const char *want; } v[] = {
+        {"", "da39a3ee5e6b4b0d3255bfef95601890afd80709"},
+        {"abc", "a9993e364706816aba3e25717850c26c9cd0d89d"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+         "84983e441c3bd26ebaae4aa1f95129e5e54670f1"},
+        {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+         "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+         "a49b2446a02c645bf419f995b67091253a04a259"},
+        {"The quick brown fox jumps over the lazy dog", "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12"},
+        {string(1000000, 'a'), "34aa973cd4c4daa4f61eeb2bdbad27316534016f"},
+    };
+    for(auto& t : v) {
+        string got = hex_of(t.in);
+        CHECK(got == t.want, "vector len=%zu: got %s want %s", t.in.size(), got.c_str(), t.want);
+    }
+
+    // raw digest and hex form must agree
+    uint8_t raw[20];
+    sha1((const uint8_t*)"abc", 3, raw);
+    CHECK(raw[0] == 0xa9 && raw[19] == 0x9d, "raw digest bytes for \"abc\"");
+}
+
+static void test_against_reference() {
+    vector<uint8_t> buf(1 << 20);
+    uint64_t x = 0x243F6A8885A308D3ULL;
+    for(auto& b : buf) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; b = (uint8_t)x; }
+
+    vector<size_t> lens;
+    for(size_t n = 0; n <= 300; n++) lens.push_back(n);
+    // either side of every block boundary up to 64 blocks
+    for(size_t blk = 5; blk <= 64; blk++) {
+        for(int d = -10; d <= 10; d++) lens.push_back(blk * 64 + d);
+    }
+    for(size_t n : {4095, 4096, 4097, 65535, 65536, 65537, 524287, 524288, 524289}) lens.push_back(n);
+    for(int i = 0; i < 200; i++) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; lens.push_back(x % buf.size()); }
+
+    int checked = 0;
+    for(size_t n : lens) {
+        // vary the start offset so unaligned input pointers are exercised too
+        const uint8_t *p = buf.data() + (n % 7);
+        if(n + 7 > buf.size()) continue;
+        char got[41];
+        sha1_hex(p, n, got);
+        string want = ref_sha1_hex(p, n);
+        CHECK(want == got, "len=%zu: got %s want %s", n, got, want.c_str());
+        checked++;
+    }
+    printf("sha1_test: %d lengths checked against reference\n", checked);
+}
+
+int main() {
+    test_vectors();
+    test_against_reference();
+    return test_summary("sha1_test");
+}
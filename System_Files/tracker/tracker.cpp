@@ -6,10 +6,19 @@
 #include <set>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+#include <atomic>
+#include <chrono>
 #include <algorithm>
 #include <sstream>
 #include <cstring>
+#include <cerrno>
 #include "../common/proto.h"
+#include "../common/metrics.h"
+#include "../common/snapshot.h"
+#include "../common/dialer.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -18,60 +27,565 @@
 
 using namespace std;
 
-struct User { 
-    string pass; 
-    bool logged; 
-    User(const string &p="") : pass(p), logged(false) {} 
+static const uint32_t NO_ID = 0xffffffffu;
+
+// Interned names. Users, groups and peer endpoints are each stored once and
+// referred to by a 32-bit id everywhere else in the registry. The index is
+// an open-addressing table of ids (linear probing, at most half full). Ids
+// are never reused. Guarded by mtx like the rest of the registry.
+class Names {
+public:
+    uint32_t find(const string& s) const {
+        if(slots_.empty()) return NO_ID;
+        size_t mask = slots_.size() - 1;
+        for(size_t i = hash<string>()(s) & mask;; i = (i + 1) & mask) {
+            uint32_t id = slots_[i];
+            if(id == NO_ID || names_[id] == s) return id;
+        }
+    }
+
+    uint32_t id(const string& s) {
+        uint32_t id = find(s);
+        if(id != NO_ID) return id;
+        names_.push_back(s);
+        if(2 * names_.size() > slots_.size()) rehash(max<size_t>(16, 2 * slots_.size()));
+        else place((uint32_t)names_.size() - 1);
+        return (uint32_t)names_.size() - 1;
+    }
+
+    const string& operator[](uint32_t id) const { return names_[id]; }
+    size_t size() const { return names_.size(); }
+    void clear() { names_.clear(); slots_.clear(); }
+
+private:
+    void place(uint32_t id) {
+        size_t mask = slots_.size() - 1, i = hash<string>()(names_[id]) & mask;
+        while(slots_[i] != NO_ID) i = (i + 1) & mask;
+        slots_[i] = id;
+    }
+    void rehash(size_t n) {
+        slots_.assign(n, NO_ID);
+        for(uint32_t id = 0; id < names_.size(); id++) place(id);
+    }
+
+    vector<string> names_;
+    vector<uint32_t> slots_;
+};
+
+static Names user_names, group_names, peer_names;
+
+// Sorted vectors used as sets. Files have a handful of peers and groups a
+// handful of members, so a flat array beats a tree node per element.
+template<class T> static bool flat_has(const vector<T>& v, const T& x) {
+    return binary_search(v.begin(), v.end(), x);
+}
+template<class T> static bool flat_insert(vector<T>& v, const T& x) {
+    auto it = lower_bound(v.begin(), v.end(), x);
+    if(it != v.end() && *it == x) return false;
+    v.insert(it, x);
+    return true;
+}
+template<class T> static bool flat_erase(vector<T>& v, const T& x) {
+    auto it = lower_bound(v.begin(), v.end(), x);
+    if(it == v.end() || *it != x) return false;
+    v.erase(it);
+    return true;
+}
+
+struct User {
+    string pass;
+    bool registered = false, logged = false;
 };
 
-struct File { 
-    string group, filename, owner, sha; 
-    uint64_t size; 
-    vector<string> piece_sha; 
-    set<string> peers; 
+struct Group {
+    uint32_t owner = NO_ID;
+    vector<uint32_t> members;  // sorted user ids
+    vector<uint32_t> requests; // pending joins, in arrival order
 };
 
-static unordered_map<string, User> users;
-static unordered_map<string, pair<string, set<string>>> groups; 
-static unordered_map<string, vector<string>> requests;
-static unordered_map<string, File> files;
+struct File {
+    string filename, sha;
+    uint32_t group = NO_ID, owner = NO_ID;
+    uint64_t size;
+    // raw 20-byte piece digests back to back, or, after a snapshot load,
+    // still in the mapping (lazy_pieces) until something needs its own copy
+    string digests;
+    const uint8_t *lazy_pieces = nullptr;
+    uint32_t lazy_count = 0;
+    vector<uint32_t> peers; // sorted peer endpoint ids
+    // bumped each time the name is re-uploaded with new content; the
+    // version before it is kept so its holders can fetch only what changed
+    uint32_t version = 1;
+    string prev_sha;
+    string prev_digests;
+
+    // GET_FILE_PEERS reply, cached in two halves: size/sha/piece list, fixed once
+    // uploaded, and the peer list, dropped whenever the peer set changes
+    shared_ptr<const string> meta_blob, peers_blob;
+    uint64_t peers_epoch = 0; // lease_epoch the peer list was built at
+
+    size_t npieces() const { return lazy_pieces ? lazy_count : digests.size() / 20; }
+    const uint8_t *digest(size_t i) const {
+        return (lazy_pieces ? lazy_pieces : (const uint8_t*)digests.data()) + 20 * i;
+    }
+    // Merkle-mode files register no piece list; sha is the tree root and
+    // peers hand out per-piece proofs instead (see common/merkle.h)
+    bool merkle() const { return size > 0 && npieces() == 0; }
+    void own_digests() {
+        if(!lazy_pieces) return;
+        digests.assign((const char*)lazy_pieces, 20 * (size_t)lazy_count);
+        lazy_pieces = nullptr;
+    }
+    // piece digests arrive as 40-digit hex; false (and nothing added) if h is not
+    bool add_digest_hex(const string& h) {
+        uint8_t raw[20];
+        if(!hex_to_raw(h, raw, 20)) return false;
+        digests.append((const char*)raw, 20);
+        return true;
+    }
+    const string& group_name() const { return group_names[group]; }
+    string key() const { return group_name() + " " + filename; }
+
+    void add_peer(const string& p) { if(flat_insert(peers, peer_names.id(p))) peers_blob.reset(); }
+    void remove_peer(const string& p) {
+        uint32_t id = peer_names.find(p);
+        if(id != NO_ID && flat_erase(peers, id)) peers_blob.reset();
+    }
+
+    shared_ptr<const string> meta();
+    shared_ptr<const string> peer_list();
+    bool reply_cached() const;
+};
+
+static vector<User> users; // by user id; only registered entries are accounts
+static size_t nusers = 0;
+static unordered_map<uint32_t, Group> groups; // by group id
+static unordered_map<string, File> files;     // by "group name"
+// content index: file sha -> keys of every entry with that content, so the
+// same file shared in several groups is served as one swarm
+static unordered_map<string, vector<string>> by_content;
 static mutex mtx;
 static vector<string> trackers;
 static int self_idx;
 static string data_dir;
+// the mapping lazily-expanded piece lists point into; open for the process lifetime
+static SnapReader snapshot_map;
+static bool eager_pieces = false;
+
+// Peer leases. A peer is only handed out by GET_FILE_PEERS while it keeps
+// renewing (HEARTBEAT, or implicitly via UPLOAD_META / ADD_PEER). A renewal
+// touches one map entry; the sweeper hides expired peers, bumping
+// lease_epoch so cached peer lists are rebuilt, and after
+// LEASE_EVICT_FACTOR TTLs drops them from the registry altogether.
+struct Lease {
+    uint64_t expires_ms;
+    bool hidden;
+};
+static const int LEASE_EVICT_FACTOR = 10;
+static uint64_t lease_ttl_ms = 30000;
+static mutex lease_mtx;
+static unordered_map<string, Lease> leases;
+static unordered_set<string> unsynced_renewals; // coalesced into one SYNC HEARTBEATS per sweep
+static atomic<uint64_t> lease_epoch(0), peers_evicted(0);
+
+// Per-event log lines; the message is not even formatted when logging is off.
+static atomic<bool> log_verbose(true);
+#define TLOG(expr) do { \
+    if(log_verbose.load(memory_order_relaxed)) { ostringstream tlog_; tlog_ << expr << '\n'; cout << tlog_.str(); } \
+} while(0)
+
+static uint64_t since_ns(chrono::steady_clock::time_point t0) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+}
+
+static const char *CMD_NAMES[] = {
+    "REGISTER", "LOGIN", "CREATE_GROUP", "JOIN_GROUP", "LIST_GROUPS", "LIST_REQUESTS", "ACCEPT_REQUEST",
+    "LEAVE_GROUP", "LIST_FILES", "GET_FILE_PEERS", "STOP_SHARE", "ADD_PEER", "UPLOAD_META", "SYNC", "STATS", "PING", "HEARTBEAT",
+    "UPLOAD_MANIFEST", "GET_DIR", "ADD_PEERS", "GET_VERSION", "ANNOUNCE", "OTHER"
+};
+static const int NCMDS = sizeof(CMD_NAMES) / sizeof(CMD_NAMES[0]);
+
+struct CmdStats {
+    atomic<uint64_t> errors;
+    LatencyHistogram latency;
+    CmdStats() : errors(0) {}
+};
+
+static CmdStats cmd_stats[NCMDS];
+static LatencyHistogram lock_wait_hist, lock_hold_hist, save_hist, sync_lag_hist;
+static thread_local bool reply_err;
+// "#<id>" a pipelining client put in front of the command; echoed on the reply
+static thread_local string reply_tag;
+
+static int cmd_slot(const string& cmd) {
+    if(cmd.compare(0, 11, "UPLOAD_META") == 0) return 12;
+    for(int i = 0; i < NCMDS - 1; i++) if(cmd == CMD_NAMES[i]) return i;
+    return NCMDS - 1;
+}
+
+// Every command reply goes through here so ERR replies can be counted.
+static bool respond(int fd, const string& s) {
+    reply_err = s.compare(0, 3, "ERR") == 0;
+    return send_msg(fd, reply_tag.empty() ? s : reply_tag + " " + s);
+}
+
+// a successful reply assembled from two prebuilt strings, without joining them
+static bool respond_parts(int fd, const string& a, const string& b) {
+    reply_err = false;
+    if(reply_tag.empty()) return send_msg_parts(fd, {&a, &b});
+    string tag = reply_tag + " ";
+    return send_msg_parts(fd, {&tag, &a, &b});
+}
+
+// The global registry lock; records time spent waiting for and holding mtx.
+struct RegistryLock {
+    unique_lock<mutex> lk;
+    chrono::steady_clock::time_point acquired;
+
+    RegistryLock() : lk(mtx, defer_lock) {
+        auto t0 = chrono::steady_clock::now();
+        lk.lock();
+        acquired = chrono::steady_clock::now();
+        lock_wait_hist.record_ns(chrono::duration_cast<chrono::nanoseconds>(acquired - t0).count());
+    }
+    ~RegistryLock() { lock_hold_hist.record_ns(since_ns(acquired)); }
+};
+
+// Outgoing replication to one peer tracker: an ordered queue drained by a
+// dedicated worker, so a slow or dead replica only delays its own queue.
+struct SyncTarget {
+    int idx;
+    string ep;
+    mutex m;
+    condition_variable cv;
+    deque<pair<string, chrono::steady_clock::time_point>> q;
+    atomic<uint64_t> sent, failed;
+    SyncTarget(int i, const string& e) : idx(i), ep(e), sent(0), failed(0) {}
+};
+
+// never freed: workers wait on these until the process exits
+static vector<SyncTarget*> sync_targets;
+
+static uint32_t user_id(const string& name) {
+    uint32_t id = user_names.id(name);
+    if(id >= users.size()) users.resize(id + 1);
+    return id;
+}
+
+static User *find_user(const string& name) {
+    uint32_t id = user_names.find(name);
+    return id != NO_ID && users[id].registered ? &users[id] : nullptr;
+}
+
+static void add_user(const string& name, const string& pass) {
+    User& u = users[user_id(name)];
+    if(!u.registered) nusers++;
+    u.registered = true;
+    u.pass = pass;
+}
+
+static Group *find_group(const string& name) {
+    auto it = groups.find(group_names.find(name));
+    return it == groups.end() ? nullptr : &it->second;
+}
 
 bool is_member(const string& user, const string& group) {
-    auto it = groups.find(group);
-    return it != groups.end() && it->second.second.count(user);
+    Group *g = find_group(group);
+    uint32_t id = user_names.find(user);
+    return g && id != NO_ID && flat_has(g->members, id);
+}
+
+// a departing owner hands the group to its first member by name, which
+// every replica agrees on whatever order it interned the names in
+static uint32_t next_owner(const Group& g) {
+    return *min_element(g.members.begin(), g.members.end(),
+                        [](uint32_t a, uint32_t b) { return user_names[a] < user_names[b]; });
+}
+
+static atomic<uint64_t> reply_cache_hits(0), meta_builds(0), peer_list_builds(0), swarm_merges(0);
+
+// files[] is only changed through these two so by_content stays in step
+static void put_file(File f) {
+    string key = f.key();
+    auto it = files.find(key);
+    if(it != files.end() && it->second.sha != f.sha) {
+        File& old = it->second;
+        auto c = by_content.find(old.sha);
+        if(c != by_content.end()) {
+            flat_erase(c->second, key);
+            if(c->second.empty()) by_content.erase(c);
+        }
+        // new content under an existing name is its next version
+        f.version = old.version + 1;
+        f.prev_sha = old.sha;
+        old.own_digests();
+        f.prev_digests.swap(old.digests);
+    } else if(it != files.end()) {
+        f.version = it->second.version;
+        f.prev_sha.swap(it->second.prev_sha);
+        f.prev_digests.swap(it->second.prev_digests);
+    }
+    flat_insert(by_content[f.sha], key);
+    files[key] = move(f);
+}
+
+static unordered_map<string, File>::iterator erase_file(unordered_map<string, File>::iterator it) {
+    auto c = by_content.find(it->second.sha);
+    if(c != by_content.end()) {
+        flat_erase(c->second, it->first);
+        if(c->second.empty()) by_content.erase(c);
+    }
+    return files.erase(it);
+}
+
+// re-add peer to a file it already shared, if the file still has that
+// content; a resuming client may be announcing a version since replaced
+static bool announce_share(const string& group, const string& name, const string& sha, const string& peer) {
+    auto it = files.find(group + " " + name);
+    if(it == files.end() || it->second.sha != sha) return false;
+    it->second.add_peer(peer);
+    return true;
+}
+
+shared_ptr<const string> File::meta() {
+    if(meta_blob) return meta_blob;
+    meta_builds++;
+    size_t n = npieces();
+    string out = to_string(size) + " " + to_string(n) + "\n" + sha + "\n";
+    out.reserve(out.size() + 41 * n + 8);
+    for(size_t i = 0; i < n; i++) {
+        if(i) out += ',';
+        out += raw_to_hex(digest(i), 20);
+    }
+    out += "\n";
+    if(!prev_sha.empty()) out += "VERSION " + to_string(version) + " " + prev_sha + "\n";
+    out += "PEERS\n";
+    meta_blob = make_shared<const string>(move(out));
+    return meta_blob;
+}
+
+// live peers only; empty when every listed peer's lease has lapsed
+shared_ptr<const string> File::peer_list() {
+    uint64_t epoch = lease_epoch.load();
+    if(peers_blob && peers_epoch == epoch) return peers_blob;
+    peer_list_builds++;
+    string out;
+    {
+        lock_guard<mutex> g(lease_mtx);
+        for(uint32_t id : peers) {
+            const string& p = peer_names[id];
+            auto it = leases.find(p);
+            if(it == leases.end() || !it->second.hidden) out += p + "\n";
+        }
+    }
+    peers_blob = make_shared<const string>(move(out));
+    peers_epoch = epoch;
+    return peers_blob;
+}
+
+bool File::reply_cached() const {
+    return meta_blob && peers_blob && peers_epoch == lease_epoch.load();
+}
+
+// Live peers of every entry with f's content in a group the user belongs to.
+// Each entry's list comes from its own cache; only the merge is per request.
+static shared_ptr<const string> swarm_peer_list(File& f, const string& user) {
+    auto c = by_content.find(f.sha);
+    if(c == by_content.end() || c->second.size() < 2) return f.peer_list();
+
+    set<string> merged;
+    for(auto& key : c->second) {
+        auto it = files.find(key);
+        if(it == files.end() || it->second.size != f.size || !is_member(user, it->second.group_name())) continue;
+        istringstream iss(*it->second.peer_list());
+        string p;
+        while(getline(iss, p)) merged.insert(p);
+    }
+    swarm_merges++;
+    string out;
+    for(auto& p : merged) out += p + "\n";
+    return make_shared<const string>(move(out));
+}
+
+static uint64_t mono_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// extend peer's lease to at least ttl_ms from now; replicate marks it for the next HEARTBEATS sync.
+// false if the peer had no lease (never seen, or evicted from every swarm).
+static bool renew_lease(const string& peer, uint64_t ttl_ms, bool replicate) {
+    uint64_t until = mono_ms() + ttl_ms;
+    lock_guard<mutex> g(lease_mtx);
+    auto ins = leases.insert(make_pair(peer, Lease{until, false}));
+    Lease& l = ins.first->second;
+    if(!ins.second) {
+        l.expires_ms = max(l.expires_ms, until);
+        if(l.hidden) {
+            l.hidden = false;
+            lease_epoch++;
+        }
+    }
+    if(replicate) unsynced_renewals.insert(peer);
+    return !ins.second;
+}
+
+// piece hashes are stored raw in the snapshot, so only 40-digit hex is accepted
+static bool is_digest_hex(const string& h) {
+    uint8_t raw[20];
+    return hex_to_raw(h, raw, 20);
+}
+
+// a decimal count from the wire or a text file; stoul would throw on junk
+static bool parse_count(const string& s, size_t& out) {
+    if(s.empty() || !isdigit((unsigned char)s[0])) return false;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s.c_str(), &end, 10);
+    if(*end || errno == ERANGE) return false;
+    out = (size_t)v;
+    return true;
+}
+
+// a flat file lists one digest per 512 KiB piece; a Merkle file lists none
+static bool piece_count_ok(uint64_t size, size_t np) {
+    const uint64_t PIECE_SZ = 512 * 1024; // the client's piece size
+    return np == 0 ? size > 0 : np == (size + PIECE_SZ - 1) / PIECE_SZ;
+}
+
+// UPLOAD_MANIFEST <group> <peer> <user> <n>, then n entries of
+// <name> <size> <npieces> <sha> <piece digests...>, starting at t[pos].
+// All or nothing: false if any entry is malformed.
+static bool parse_manifest(const vector<string>& t, size_t pos, string& group, string& peer, string& user,
+                           vector<File>& out) {
+    if(t.size() < pos + 4) return false;
+    group = t[pos]; peer = t[pos + 1]; user = t[pos + 2];
+    size_t n;
+    if(!parse_count(t[pos + 3], n)) return false;
+    pos += 4;
+    out.clear();
+    for(size_t i = 0; i < n; i++) {
+        if(t.size() < pos + 4) return false;
+        File f;
+        f.group = group_names.id(group);
+        f.filename = t[pos];
+        size_t size, np;
+        if(!parse_count(t[pos + 1], size) || !parse_count(t[pos + 2], np) || !piece_count_ok(size, np)) return false;
+        f.size = size;
+        f.sha = t[pos + 3];
+        pos += 4;
+        if(!is_digest_hex(f.sha) || t.size() - pos < np) return false;
+        f.digests.reserve(20 * np);
+        for(size_t end = pos + np; pos < end; pos++) if(!f.add_digest_hex(t[pos])) return false;
+        f.owner = user_id(user);
+        f.add_peer(peer);
+        out.push_back(move(f));
+    }
+    return pos == t.size();
 }
 
 bool is_owner(const string& user, const string& group) {
-    auto it = groups.find(group);
-    return it != groups.end() && it->second.first == user;
+    Group *g = find_group(group);
+    return g && g->owner == user_names.find(user);
+}
+
+// user (a member) leaves group: their files there go, and an owner hands
+// the group on, or deletes it if nobody is left
+static void leave_group(const string& user, const string& group) {
+    uint32_t uid = user_names.find(user), gid = group_names.find(group);
+    Group& g = groups[gid];
+    flat_erase(g.members, uid);
+
+    for(auto it = files.begin(); it != files.end();) {
+        if(it->second.group == gid && it->second.owner == uid) {
+            it = erase_file(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if(g.owner == uid) {
+        if(g.members.empty()) groups.erase(gid);
+        else g.owner = next_owner(g);
+    }
 }
 
+// Registry snapshot: every mutation rewrites registry.snap (see common/snapshot.h)
+// as users, groups, requests, files sections, each a u32 count plus records.
 void save() {
+    auto t0 = chrono::steady_clock::now();
+    mkdir(data_dir.c_str(), 0755);
+
+    SnapWriter w;
+    w.u32((uint32_t)nusers);
+    for(uint32_t id = 0; id < users.size(); id++) {
+        if(!users[id].registered) continue;
+        w.str(user_names[id]);
+        w.str(users[id].pass);
+    }
+
+    w.u32((uint32_t)groups.size());
+    for(auto& p : groups) {
+        w.str(group_names[p.first]);
+        w.str(user_names[p.second.owner]);
+        w.u32((uint32_t)p.second.members.size());
+        for(uint32_t m : p.second.members) w.str(user_names[m]);
+    }
+
+    w.u32((uint32_t)groups.size());
+    for(auto& p : groups) {
+        w.str(group_names[p.first]);
+        w.u32((uint32_t)p.second.requests.size());
+        for(uint32_t u : p.second.requests) w.str(user_names[u]);
+    }
+
+    w.u32((uint32_t)files.size());
+    for(auto& p : files) {
+        auto& f = p.second;
+        w.str(f.group_name());
+        w.str(f.filename);
+        w.str(user_names[f.owner]);
+        w.str(f.sha);
+        w.u64(f.size);
+        w.u32((uint32_t)f.npieces());
+        w.raw(f.digest(0), 20 * f.npieces());
+        w.u32((uint32_t)f.peers.size());
+        for(uint32_t peer : f.peers) w.str(peer_names[peer]);
+        w.u32(f.version);
+        w.str(f.prev_sha);
+        w.u32((uint32_t)(f.prev_digests.size() / 20));
+        w.raw(f.prev_digests.data(), f.prev_digests.size());
+    }
+
+    if(!w.commit(data_dir + "/registry.snap")) cerr << "snapshot write failed in " << data_dir << "\n";
+
+    save_hist.record_ns(since_ns(t0));
+    TLOG("Data saved to " << data_dir);
+}
+
+// The pre-snapshot text format, still written on demand ("export" on the
+// console) for inspection and read at startup when no snapshot exists.
+void export_text() {
     mkdir(data_dir.c_str(), 0755);
 
     ofstream uf(data_dir + "/users.txt");
-    for(auto& p : users) {
-        uf << p.first << " " << p.second.pass << "\n";
+    for(uint32_t id = 0; id < users.size(); id++) {
+        if(users[id].registered) uf << user_names[id] << " " << users[id].pass << "\n";
     }
     uf.close();
 
     ofstream gf(data_dir + "/groups.txt");
     for(auto& p : groups) {
-        gf << p.first << " " << p.second.first;
-        for(auto& m : p.second.second) gf << " " << m;
+        gf << group_names[p.first] << " " << user_names[p.second.owner];
+        for(uint32_t m : p.second.members) gf << " " << user_names[m];
         gf << "\n";
     }
     gf.close();
 
     ofstream rf(data_dir + "/requests.txt");
-    for(auto& p : requests) {
-        if(!p.second.empty()) {
-            rf << p.first;
-            for(auto& u : p.second) rf << " " << u;
+    for(auto& p : groups) {
+        if(!p.second.requests.empty()) {
+            rf << group_names[p.first];
+            for(uint32_t u : p.second.requests) rf << " " << user_names[u];
             rf << "\n";
         }
     }
@@ -80,20 +594,18 @@ void save() {
     ofstream ff(data_dir + "/files.txt");
     for(auto& p : files) {
         auto& f = p.second;
-        ff << f.group << " " << f.filename << " " << f.size << " " << f.piece_sha.size() << " " << f.sha << " " << f.owner;
-        for(size_t i = 0; i < f.piece_sha.size(); i++) ff << (i ? "," : " ") << f.piece_sha[i];
-        for(auto& peer : f.peers) ff << " " << peer;
+        size_t n = f.npieces();
+        ff << f.group_name() << " " << f.filename << " " << f.size << " " << n << " " << f.sha << " " << user_names[f.owner];
+        for(size_t i = 0; i < n; i++) ff << (i ? "," : " ") << raw_to_hex(f.digest(i), 20);
+        if(f.merkle()) ff << " -"; // keeps the piece column for load_text
+        for(uint32_t peer : f.peers) ff << " " << peer_names[peer];
         ff << "\n";
     }
     ff.close();
-
-    cout << "Data saved to " << data_dir << endl;
+    TLOG("Text export written to " << data_dir);
 }
 
-void load() {
-    data_dir = "tracker_data_" + to_string(self_idx);
-    cout << "Loading data from " << data_dir << endl;
-
+static bool load_text() {
     ifstream uf(data_dir + "/users.txt"), gf(data_dir + "/groups.txt"), rf(data_dir + "/requests.txt"), ff(data_dir + "/files.txt");
     string line, u, p, g, o, m;
 
@@ -101,8 +613,8 @@ void load() {
     while(getline(uf, line) && !line.empty()) {
         istringstream iss(line);
         if(iss >> u >> p) {
-            users[u] = User(p);
-            cout << "Loaded user: " << u << endl;
+            add_user(u, p);
+            TLOG("Loaded user: " << u);
         }
     }
 
@@ -110,21 +622,20 @@ void load() {
     while(getline(gf, line) && !line.empty()) {
         istringstream iss(line);
         if(iss >> g >> o) {
-            set<string> members;
-            while(iss >> m) members.insert(m);
-            groups[g] = make_pair(o, members);
-            cout << "Loaded group: " << g << " owner: " << o << endl;
+            Group& grp = groups[group_names.id(g)];
+            grp.owner = user_id(o);
+            while(iss >> m) flat_insert(grp.members, user_id(m));
+            TLOG("Loaded group: " << g << " owner: " << o);
         }
     }
 
     // Load requests
     while(getline(rf, line) && !line.empty()) {
         istringstream iss(line);
-        if(iss >> g) {
-            vector<string> reqs;
-            while(iss >> u) reqs.push_back(u);
-            requests[g] = reqs;
-            cout << "Loaded requests for group: " << g << endl;
+        Group *grp;
+        if(iss >> g && (grp = find_group(g))) {
+            while(iss >> u) grp->requests.push_back(user_id(u));
+            TLOG("Loaded requests for group: " << g);
         }
     }
 
@@ -133,28 +644,121 @@ void load() {
         istringstream iss(line);
         File file;
         string np_str, token;
-        if(iss >> file.group >> file.filename >> file.size >> np_str >> file.sha >> file.owner && iss >> token) {
-            int np = stoi(np_str);
-            size_t pos = 0;
-            while(pos < token.size() && (int)file.piece_sha.size() < np) {
+        size_t np, pos = 0;
+        if(iss >> g >> file.filename >> file.size >> np_str >> file.sha >> o && iss >> token && parse_count(np_str, np)) {
+            file.group = group_names.id(g);
+            file.owner = user_id(o);
+            while(pos < token.size() && file.npieces() < np) {
                 while(pos < token.size() && !isxdigit(token[pos])) pos++;
                 if(pos + 40 <= token.size()) {
-                    file.piece_sha.push_back(token.substr(pos, 40));
+                    file.add_digest_hex(token.substr(pos, 40));
                     pos += 40;
                 }
             }
-            while(iss >> token) file.peers.insert(token);
-            files[file.group + " " + file.filename] = file;
-            cout << "Loaded file: " << file.filename << " in group: " << file.group << endl;
+            while(iss >> token) file.add_peer(token);
+            TLOG("Loaded file: " << file.filename << " in group: " << g);
+            put_file(move(file));
         }
     }
+    return uf.is_open() || gf.is_open() || rf.is_open() || ff.is_open();
 }
 
-bool fire_and_forget(const string& ep, const string& msg) {
-    size_t p = ep.find(':');
-    if(p == string::npos) return false;
+static bool load_snapshot(string& err) {
+    SnapReader& r = snapshot_map;
+    if(!r.open(data_dir + "/registry.snap", &err)) return false;
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    uint32_t n, k;
+    string a, b;
+    bool ok = r.u32(n);
+    users.reserve(n);
+    for(uint32_t i = 0; ok && i < n; i++) {
+        ok = r.str(a) && r.str(b);
+        if(ok) add_user(a, b);
+    }
+
+    ok = ok && r.u32(n);
+    groups.reserve(n);
+    for(uint32_t i = 0; ok && i < n; i++) {
+        ok = r.str(a) && r.str(b) && r.u32(k);
+        Group& grp = groups[group_names.id(a)];
+        grp.owner = user_id(b);
+        grp.members.reserve(k);
+        for(uint32_t j = 0; ok && j < k; j++) {
+            ok = r.str(a);
+            flat_insert(grp.members, user_id(a));
+        }
+    }
+
+    ok = ok && r.u32(n);
+    for(uint32_t i = 0; ok && i < n; i++) {
+        ok = r.str(a) && r.u32(k);
+        Group *grp = find_group(a);
+        for(uint32_t j = 0; ok && j < k; j++) {
+            ok = r.str(b);
+            if(grp) grp->requests.push_back(user_id(b));
+        }
+    }
+
+    ok = ok && r.u32(n);
+    files.reserve(n);
+    for(uint32_t i = 0; ok && i < n; i++) {
+        File f;
+        uint32_t np;
+        const uint8_t *digests = nullptr;
+        ok = r.str(a) && r.str(f.filename) && r.str(b) && r.str(f.sha) &&
+             r.u64(f.size) && r.u32(np) && r.raw(digests, 20 * (size_t)np) && r.u32(k);
+        f.group = group_names.id(a);
+        f.owner = user_id(b);
+        f.peers.reserve(k);
+        for(uint32_t j = 0; ok && j < k; j++) {
+            ok = r.str(a);
+            f.add_peer(a);
+        }
+        if(ok && r.version() >= 2) { // version history
+            const uint8_t *prev = nullptr;
+            ok = r.u32(f.version) && r.str(f.prev_sha) && r.u32(k) && r.raw(prev, 20 * (size_t)k);
+            if(ok) f.prev_digests.assign((const char*)prev, 20 * (size_t)k);
+        }
+        if(!ok) break;
+        f.lazy_pieces = digests;
+        f.lazy_count = np;
+        if(eager_pieces) f.own_digests();
+        put_file(move(f));
+    }
+
+    if(!ok || !r.at_end()) {
+        err = "malformed payload";
+        users.clear(); groups.clear(); files.clear(); by_content.clear();
+        nusers = 0;
+        user_names.clear(); group_names.clear(); peer_names.clear();
+        r.close();
+        return false;
+    }
+    // nothing points into the mapping once every piece list is copied out
+    if(eager_pieces) r.close();
+    return true;
+}
+
+void load() {
+    data_dir = "tracker_data_" + to_string(self_idx);
+    TLOG("Loading data from " << data_dir);
+
+    auto t0 = chrono::steady_clock::now();
+    string err;
+    const char *source = "snapshot";
+    if(!load_snapshot(err)) {
+        if(err != "missing") cerr << "ignoring " << data_dir << "/registry.snap: " << err << "\n";
+        source = load_text() ? "text files" : "empty";
+    }
+    printf("Loaded %zu users, %zu groups, %zu files from %s in %.1f ms\n", nusers, groups.size(),
+           files.size(), source, since_ns(t0) / 1e6);
+}
+
+// a replica that is down costs at most this long per sync attempt
+static const int SYNC_DIAL_TIMEOUT_MS = 2000;
+
+bool fire_and_forget(const string& ep, const string& msg) {
+    int fd = dial(ep, SYNC_DIAL_TIMEOUT_MS);
     if(fd < 0) return false;
 
     struct timeval timeout;
@@ -163,17 +767,6 @@ bool fire_and_forget(const string& ep, const string& msg) {
     setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
     setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-    sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(stoi(ep.substr(p+1)));
-    sa.sin_addr.s_addr = inet_addr(ep.substr(0,p).c_str());
-
-    if(connect(fd, (sockaddr*)&sa, sizeof(sa)) < 0) {
-        close(fd);
-        return false;
-    }
-
     bool ok = send_msg(fd, msg);
     if(ok) {
         string rep;
@@ -183,18 +776,104 @@ bool fire_and_forget(const string& ep, const string& msg) {
     return ok;
 }
 
+void sync_worker(SyncTarget *t) {
+    while(true) {
+        pair<string, chrono::steady_clock::time_point> op;
+        {
+            unique_lock<mutex> lk(t->m);
+            t->cv.wait(lk, [t]() { return !t->q.empty(); });
+            op = t->q.front();
+            t->q.pop_front();
+        }
+
+        if(!fire_and_forget(t->ep, "SYNC " + op.first)) {
+            t->failed++;
+            TLOG("Warning: Failed to sync to tracker " << t->idx << ": " << t->ep);
+        } else {
+            t->sent++;
+            TLOG("Synced to tracker " << t->idx << ": " << op.first);
+        }
+        sync_lag_hist.record_ns(since_ns(op.second));
+    }
+}
+
+void start_sync_workers() {
+    for(size_t i = 0; i < trackers.size(); ++i) {
+        if((int)i == self_idx) continue;
+        sync_targets.push_back(new SyncTarget((int)i, trackers[i]));
+        thread(sync_worker, sync_targets.back()).detach();
+    }
+}
+
 void broadcast_sync(const string& cmd) {
-    thread([cmd]() {
-        for(size_t i = 0; i < trackers.size(); ++i) {
-            if((int)i != self_idx) {
-                if(!fire_and_forget(trackers[i], "SYNC " + cmd)) {
-                    cout << "Warning: Failed to sync to tracker " << i << ": " << trackers[i] << endl;
+    auto now = chrono::steady_clock::now();
+    for(auto& t : sync_targets) {
+        {
+            lock_guard<mutex> lk(t->m);
+            t->q.push_back(make_pair(cmd, now));
+        }
+        t->cv.notify_one();
+    }
+}
+
+// Once a second: replicate the renewals seen since the last tick, hide peers
+// whose lease ran out and evict the ones that have been gone for a long time.
+void lease_sweeper() {
+    const size_t SYNC_BATCH = 20000; // peers per SYNC HEARTBEATS, well under the message cap
+    while(true) {
+        this_thread::sleep_for(chrono::seconds(1));
+
+        unordered_set<string> renewed;
+        vector<string> evict;
+        uint64_t now = mono_ms(), evict_ms = lease_ttl_ms * LEASE_EVICT_FACTOR;
+        {
+            lock_guard<mutex> g(lease_mtx);
+            renewed.swap(unsynced_renewals);
+            for(auto it = leases.begin(); it != leases.end();) {
+                Lease& l = it->second;
+                if(!l.hidden && l.expires_ms <= now) {
+                    l.hidden = true;
+                    lease_epoch++;
+                    TLOG("Lease expired: " << it->first);
+                }
+                if(l.expires_ms + evict_ms <= now) {
+                    evict.push_back(it->first);
+                    it = leases.erase(it);
                 } else {
-                    cout << "Synced to tracker " << i << ": " << cmd << endl;
+                    ++it;
                 }
             }
         }
-    }).detach();
+
+        string batch;
+        size_t n = 0;
+        for(auto& p : renewed) {
+            batch += " " + p;
+            if(++n % SYNC_BATCH == 0 || n == renewed.size()) {
+                broadcast_sync("HEARTBEATS " + to_string(lease_ttl_ms) + batch);
+                batch.clear();
+            }
+        }
+
+        if(!evict.empty()) {
+            RegistryLock g;
+            for(auto it = files.begin(); it != files.end();) {
+                for(auto& p : evict) it->second.remove_peer(p);
+                if(it->second.peers.empty()) it = erase_file(it);
+                else ++it;
+            }
+            peers_evicted += evict.size();
+            save();
+            TLOG("Evicted " << evict.size() << " dead peer(s)");
+        }
+    }
+}
+
+// every peer known at startup gets one TTL of grace to start heartbeating
+void grant_startup_leases() {
+    for(auto& p : files) {
+        for(uint32_t peer : p.second.peers) renew_lease(peer_names[peer], lease_ttl_ms, false);
+    }
 }
 
 // Handle sync operations with UPLOAD_META prefix handling
@@ -203,72 +882,53 @@ void handle_sync(const string& sync_data) {
     string cmd;
     if(!(iss >> cmd)) return;
 
-    cout << "Processing sync: " << sync_data << endl;
+    TLOG("Processing sync: " << sync_data);
 
     if(cmd == "REGISTER") {
         string user, pass;
         if(iss >> user >> pass) {
-            users[user] = User(pass);
-            cout << "Synced user registration: " << user << endl;
+            add_user(user, pass);
+            TLOG("Synced user registration: " << user);
         }
     }
     else if(cmd == "CREATE_GROUP") {
         string user, group;
         if(iss >> user >> group) {
-            set<string> members; 
-            members.insert(user);
-            groups[group] = make_pair(user, members);
-            cout << "Synced group creation: " << group << " by " << user << endl;
+            Group& g = groups[group_names.id(group)];
+            g.owner = user_id(user);
+            g.members.assign(1, g.owner);
+            g.requests.clear();
+            TLOG("Synced group creation: " << group << " by " << user);
         }
     }
     else if(cmd == "JOIN_GROUP") {
         string user, group;
-        if(iss >> user >> group) {
-            auto& v = requests[group];
-            if(find(v.begin(), v.end(), user) == v.end()) {
-                v.push_back(user);
-                cout << "Synced join request: " << user << " -> " << group << endl;
+        Group *g;
+        if(iss >> user >> group && (g = find_group(group))) {
+            uint32_t id = user_id(user);
+            if(find(g->requests.begin(), g->requests.end(), id) == g->requests.end()) {
+                g->requests.push_back(id);
+                TLOG("Synced join request: " << user << " -> " << group);
             }
         }
     }
     else if(cmd == "ACCEPT_REQUEST") {
         string group, user;
-        if(iss >> group >> user) {
-            auto& v = requests[group];
-            auto it = find(v.begin(), v.end(), user);
-            if(it != v.end()) {
-                v.erase(it);
-                groups[group].second.insert(user);
-                cout << "Synced request acceptance: " << user << " joined " << group << endl;
+        Group *g;
+        if(iss >> group >> user && (g = find_group(group))) {
+            auto it = find(g->requests.begin(), g->requests.end(), user_names.find(user));
+            if(it != g->requests.end()) {
+                flat_insert(g->members, *it);
+                g->requests.erase(it);
+                TLOG("Synced request acceptance: " << user << " joined " << group);
             }
         }
     }
     else if(cmd == "LEAVE_GROUP") {
         string user, group;
-        if(iss >> user >> group) {
-            auto git = groups.find(group);
-            if(git != groups.end() && git->second.second.count(user)) {
-                git->second.second.erase(user);
-
-                // Remove files owned by leaving user
-                for(auto it = files.begin(); it != files.end();) {
-                    if(it->second.group == group && it->second.owner == user) {
-                        it = files.erase(it);
-                    } else {
-                        ++it;
-                    }
-                }
-
-                if(git->second.first == user) {
-                    if(git->second.second.empty()) {
-                        groups.erase(group);
-                        requests.erase(group);
-                    } else {
-                        git->second.first = *git->second.second.begin();
-                    }
-                }
-                cout << "Synced group leave: " << user << " left " << group << endl;
-            }
+        if(iss >> user >> group && is_member(user, group)) {
+            leave_group(user, group);
+            TLOG("Synced group leave: " << user << " left " << group);
         }
     }
     else if(cmd == "STOP_SHARE") {
@@ -277,12 +937,12 @@ void handle_sync(const string& sync_data) {
             string key = group + " " + filename;
             auto it = files.find(key);
             if(it != files.end()) {
-                it->second.peers.erase(peer);
+                it->second.remove_peer(peer);
                 if(it->second.peers.empty()) {
-                    files.erase(it);
-                    cout << "Synced file removal: " << filename << " from " << group << endl;
+                    erase_file(it);
+                    TLOG("Synced file removal: " << filename << " from " << group);
                 } else {
-                    cout << "Synced peer removal: " << peer << " from " << filename << endl;
+                    TLOG("Synced peer removal: " << peer << " from " << filename);
                 }
             }
         }
@@ -292,30 +952,56 @@ void handle_sync(const string& sync_data) {
         if(iss >> group >> filename >> peer) {
             string key = group + " " + filename;
             auto it = files.find(key);
+            renew_lease(peer, lease_ttl_ms, false);
             if(it != files.end()) {
-                it->second.peers.insert(peer);
-                cout << "Synced peer addition: " << peer << " to " << filename << endl;
+                it->second.add_peer(peer);
+                TLOG("Synced peer addition: " << peer << " to " << filename);
+            }
+        }
+    }
+    else if(cmd == "UPLOAD_MANIFEST") {
+        string group, peer, user;
+        vector<File> batch;
+        if(parse_manifest(split_ws(sync_data), 1, group, peer, user, batch)) {
+            renew_lease(peer, lease_ttl_ms, false);
+            for(auto& f : batch) put_file(move(f));
+            TLOG("Synced manifest: " << batch.size() << " files in " << group << " by " << user);
+        }
+    }
+    else if(cmd == "ADD_PEERS") {
+        string group, peer, name;
+        if(iss >> group >> peer) {
+            renew_lease(peer, lease_ttl_ms, false);
+            while(iss >> name) {
+                auto it = files.find(group + " " + name);
+                if(it != files.end()) it->second.add_peer(peer);
             }
+            TLOG("Synced peer addition: " << peer << " to files in " << group);
+        }
+    }
+    else if(cmd == "ANNOUNCE") {
+        string peer, group, name, sha;
+        if(iss >> peer) {
+            renew_lease(peer, lease_ttl_ms, false);
+            while(iss >> group >> name >> sha) announce_share(group, name, sha, peer);
+            TLOG("Synced announce from " << peer);
         }
     }
     else if(cmd == "UPLOAD_META") {
         File file;
-        string peer, user, np_str;
-        if(iss >> file.group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user) {
-            int np = stoi(np_str);
-
+        string group, peer, user, np_str;
+        size_t np;
+        if(iss >> group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user && parse_count(np_str, np)) {
             string hash;
-            while(iss >> hash && (int)file.piece_sha.size() < np) {
-                if(hash.length() == 40) {
-                    file.piece_sha.push_back(hash);
-                }
-            }
+            while(iss >> hash && file.npieces() < np) file.add_digest_hex(hash);
 
-            if((int)file.piece_sha.size() == np) {
-                file.owner = user;
-                file.peers.insert(peer);
-                files[file.group + " " + file.filename] = file;
-                cout << "Synced file upload: " << file.filename << " in " << file.group << " by " << user << endl;
+            if(file.npieces() == np) {
+                file.group = group_names.id(group);
+                file.owner = user_id(user);
+                file.add_peer(peer);
+                renew_lease(peer, lease_ttl_ms, false);
+                put_file(file);
+                TLOG("Synced file upload: " << file.filename << " in " << group << " by " << user);
             }
         }
     }
@@ -324,27 +1010,24 @@ void handle_sync(const string& sync_data) {
         // Reset the istringstream to process the entire sync_data as file upload
         istringstream file_iss(sync_data);
         File file;
-        string peer, user, np_str;
-        if(file_iss >> file.group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user) {
-            int np = stoi(np_str);
-
+        string group, peer, user, np_str;
+        size_t np;
+        if(file_iss >> group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user && parse_count(np_str, np)) {
             string hash;
-            while(file_iss >> hash && (int)file.piece_sha.size() < np) {
-                if(hash.length() == 40) {
-                    file.piece_sha.push_back(hash);
-                }
-            }
+            while(file_iss >> hash && file.npieces() < np) file.add_digest_hex(hash);
 
-            if((int)file.piece_sha.size() == np) {
-                file.owner = user;
-                file.peers.insert(peer);
-                files[file.group + " " + file.filename] = file;
-                cout << "Synced file upload (auto-detected): " << file.filename << " in " << file.group << " by " << user << endl;
+            if(file.npieces() == np) {
+                file.group = group_names.id(group);
+                file.owner = user_id(user);
+                file.add_peer(peer);
+                renew_lease(peer, lease_ttl_ms, false);
+                put_file(file);
+                TLOG("Synced file upload (auto-detected): " << file.filename << " in " << group << " by " << user);
             } else {
-                cout << "Unknown sync command: " << cmd << endl;
+                TLOG("Unknown sync command: " << cmd);
             }
         } else {
-            cout << "Unknown sync command: " << cmd << endl;
+            TLOG("Unknown sync command: " << cmd);
         }
     }
 
@@ -352,211 +1035,387 @@ void handle_sync(const string& sync_data) {
     save();
 }
 
+// Prometheus text exposition of everything the tracker measures
+string metrics_text() {
+    string out;
+    char line[256];
+
+    out += "# TYPE p2p_tracker_command_errors_total counter\n";
+    for(int i = 0; i < NCMDS; i++) {
+        if(!cmd_stats[i].latency.count()) continue;
+        snprintf(line, sizeof(line), "p2p_tracker_command_errors_total{cmd=\"%s\"} %llu\n", CMD_NAMES[i],
+                 (unsigned long long)cmd_stats[i].errors.load());
+        out += line;
+    }
+    out += "# TYPE p2p_tracker_command_duration_seconds histogram\n";
+    for(int i = 0; i < NCMDS; i++) {
+        if(!cmd_stats[i].latency.count()) continue;
+        cmd_stats[i].latency.write_prometheus(out, "p2p_tracker_command_duration_seconds", string("cmd=\"") + CMD_NAMES[i] + "\"");
+    }
+
+    out += "# TYPE p2p_tracker_lock_wait_seconds histogram\n";
+    lock_wait_hist.write_prometheus(out, "p2p_tracker_lock_wait_seconds", "");
+    out += "# TYPE p2p_tracker_lock_hold_seconds histogram\n";
+    lock_hold_hist.write_prometheus(out, "p2p_tracker_lock_hold_seconds", "");
+    out += "# TYPE p2p_tracker_save_seconds histogram\n";
+    save_hist.write_prometheus(out, "p2p_tracker_save_seconds", "");
+    out += "# TYPE p2p_tracker_sync_lag_seconds histogram\n";
+    sync_lag_hist.write_prometheus(out, "p2p_tracker_sync_lag_seconds", "");
+
+    out += "# TYPE p2p_tracker_sync_queue_depth gauge\n";
+    for(auto& t : sync_targets) {
+        size_t depth;
+        {
+            lock_guard<mutex> lk(t->m);
+            depth = t->q.size();
+        }
+        snprintf(line, sizeof(line), "p2p_tracker_sync_queue_depth{peer=\"%d\"} %zu\n"
+                 "p2p_tracker_sync_sent_total{peer=\"%d\"} %llu\n"
+                 "p2p_tracker_sync_failures_total{peer=\"%d\"} %llu\n",
+                 t->idx, depth, t->idx, (unsigned long long)t->sent.load(), t->idx, (unsigned long long)t->failed.load());
+        out += line;
+    }
+
+    snprintf(line, sizeof(line), "# TYPE p2p_tracker_reply_cache_hits_total counter\n"
+             "p2p_tracker_reply_cache_hits_total %llu\n"
+             "# TYPE p2p_tracker_reply_cache_builds_total counter\n"
+             "p2p_tracker_reply_cache_builds_total{part=\"pieces\"} %llu\n"
+             "p2p_tracker_reply_cache_builds_total{part=\"peers\"} %llu\n",
+             (unsigned long long)reply_cache_hits.load(), (unsigned long long)meta_builds.load(),
+             (unsigned long long)peer_list_builds.load());
+    out += line;
+    snprintf(line, sizeof(line), "# TYPE p2p_tracker_swarm_merges_total counter\n"
+             "p2p_tracker_swarm_merges_total %llu\n", (unsigned long long)swarm_merges.load());
+    out += line;
+
+    size_t live = 0, expired = 0;
+    {
+        lock_guard<mutex> g(lease_mtx);
+        for(auto& l : leases) (l.second.hidden ? expired : live)++;
+    }
+    snprintf(line, sizeof(line), "# TYPE p2p_tracker_peer_leases gauge\n"
+             "p2p_tracker_peer_leases{state=\"live\"} %zu\n"
+             "p2p_tracker_peer_leases{state=\"expired\"} %zu\n"
+             "# TYPE p2p_tracker_peers_evicted_total counter\n"
+             "p2p_tracker_peers_evicted_total %llu\n", live, expired, (unsigned long long)peers_evicted.load());
+    out += line;
+
+    size_t nu, ng, nf, nc;
+    {
+        RegistryLock g;
+        nu = nusers; ng = groups.size(); nf = files.size(); nc = by_content.size();
+    }
+    snprintf(line, sizeof(line), "# TYPE p2p_tracker_registry_entries gauge\n"
+             "p2p_tracker_registry_entries{kind=\"users\"} %zu\n"
+             "p2p_tracker_registry_entries{kind=\"groups\"} %zu\n"
+             "p2p_tracker_registry_entries{kind=\"files\"} %zu\n"
+             "p2p_tracker_registry_entries{kind=\"contents\"} %zu\n", nu, ng, nf, nc);
+    out += line;
+    return out;
+}
+
 void handle_command(const vector<string>& parts, int fd) {
     string cmd = parts[0];
 
     if(cmd == "REGISTER" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
-        if(users.count(parts[1])) {
-            send_msg(fd, "ERR user_exists");
+        RegistryLock g;
+        if(find_user(parts[1])) {
+            respond(fd, "ERR user_exists");
         } else {
-            users[parts[1]] = User(parts[2]);
+            add_user(parts[1], parts[2]);
             save(); // Save immediately
-            send_msg(fd, "OK");
+            respond(fd, "OK");
             broadcast_sync("REGISTER " + parts[1] + " " + parts[2]);
         }
     }
     else if(cmd == "LOGIN" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
-        auto it = users.find(parts[1]);
-        if(it == users.end()) {
-            send_msg(fd, "ERR user_not_found");
-        } else if(it->second.pass != parts[2]) {
-            send_msg(fd, "ERR wrong_password");
+        RegistryLock g;
+        User *u = find_user(parts[1]);
+        if(!u) {
+            respond(fd, "ERR user_not_found");
+        } else if(u->pass != parts[2]) {
+            respond(fd, "ERR wrong_password");
         } else {
-            it->second.logged = true;
+            u->logged = true;
             save(); // Save login state
-            send_msg(fd, "OK");
+            respond(fd, "OK");
         }
     }
     else if(cmd == "CREATE_GROUP" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
-        if(groups.count(parts[2])) {
-            send_msg(fd, "ERR grp_exists");
+        RegistryLock g;
+        if(find_group(parts[2])) {
+            respond(fd, "ERR grp_exists");
         } else {
-            set<string> members; 
-            members.insert(parts[1]); 
-            groups[parts[2]] = make_pair(parts[1], members);
+            Group& grp = groups[group_names.id(parts[2])];
+            grp.owner = user_id(parts[1]);
+            grp.members.assign(1, grp.owner);
             save(); // Save immediately
-            send_msg(fd, "OK");
+            respond(fd, "OK");
             broadcast_sync("CREATE_GROUP " + parts[1] + " " + parts[2]);
         }
     }
     else if(cmd == "JOIN_GROUP" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
-        if(!groups.count(parts[2])) {
-            send_msg(fd, "ERR no_group");
+        RegistryLock g;
+        Group *grp = find_group(parts[2]);
+        if(!grp) {
+            respond(fd, "ERR no_group");
         } else if(is_member(parts[1], parts[2])) {
-            send_msg(fd, "ERR already_member");
+            respond(fd, "ERR already_member");
         } else {
-            auto& v = requests[parts[2]]; 
-            if(find(v.begin(), v.end(), parts[1]) == v.end()) v.push_back(parts[1]);
+            auto& v = grp->requests;
+            uint32_t id = user_id(parts[1]);
+            if(find(v.begin(), v.end(), id) == v.end()) v.push_back(id);
             save(); // Save immediately
-            send_msg(fd, "OK");
+            respond(fd, "OK");
             broadcast_sync("JOIN_GROUP " + parts[1] + " " + parts[2]);
         }
     }
     else if(cmd == "LIST_GROUPS") {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         string out;
         for(auto& p : groups) {
-            out += p.first + "\n";
+            out += group_names[p.first] + "\n";
         }
-        send_msg(fd, out);
+        respond(fd, out);
     }
     else if(cmd == "LIST_REQUESTS" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         if(!is_owner(parts[2], parts[1])) {
-            send_msg(fd, "ERR not_owner");
+            respond(fd, "ERR not_owner");
         } else {
             string out;
-            for(auto& u : requests[parts[1]]) out += u + "\n";
-            send_msg(fd, out);
+            for(uint32_t u : find_group(parts[1])->requests) out += user_names[u] + "\n";
+            respond(fd, out);
         }
     }
     else if(cmd == "ACCEPT_REQUEST" && parts.size() == 4) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         if(!is_owner(parts[3], parts[1])) {
-            send_msg(fd, "ERR not_owner");
+            respond(fd, "ERR not_owner");
         } else {
-            auto& v = requests[parts[1]];
-            auto it = find(v.begin(), v.end(), parts[2]);
+            Group *grp = find_group(parts[1]);
+            auto& v = grp->requests;
+            auto it = find(v.begin(), v.end(), user_names.find(parts[2]));
             if(it == v.end()) {
-                send_msg(fd, "ERR no_request");
+                respond(fd, "ERR no_request");
             } else {
+                flat_insert(grp->members, *it);
                 v.erase(it);
-                groups[parts[1]].second.insert(parts[2]);
                 save(); // Save immediately
-                send_msg(fd, "OK");
+                respond(fd, "OK");
                 broadcast_sync("ACCEPT_REQUEST " + parts[1] + " " + parts[2]);
             }
         }
     }
     else if(cmd == "LEAVE_GROUP" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         if(!is_member(parts[1], parts[2])) {
-            send_msg(fd, "ERR not_member");
+            respond(fd, "ERR not_member");
         } else {
-            auto& gi = groups[parts[2]];
-            gi.second.erase(parts[1]);
-
-            for(auto it = files.begin(); it != files.end();) {
-                if(it->second.group == parts[2] && it->second.owner == parts[1]) {
-                    it = files.erase(it);
-                } else {
-                    ++it;
-                }
-            }
-
-            if(gi.first == parts[1]) {
-                if(gi.second.empty()) {
-                    groups.erase(parts[2]);
-                    requests.erase(parts[2]);
-                } else {
-                    gi.first = *gi.second.begin();
-                }
-            }
+            leave_group(parts[1], parts[2]);
             save(); // Save immediately
-            send_msg(fd, "OK");
+            respond(fd, "OK");
             broadcast_sync("LEAVE_GROUP " + parts[1] + " " + parts[2]);
         }
     }
     else if(cmd == "LIST_FILES" && parts.size() == 3) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         if(!is_member(parts[2], parts[1])) {
-            send_msg(fd, "ERR not_member");
+            respond(fd, "ERR not_member");
         } else {
             string out;
+            uint32_t gid = group_names.find(parts[1]);
             for(auto& p : files) {
-                if(p.second.group == parts[1]) out += p.second.filename + "\n";
+                if(p.second.group == gid) out += p.second.filename + "\n";
             }
-            send_msg(fd, out);
+            respond(fd, out);
         }
     }
     else if(cmd == "GET_FILE_PEERS" && parts.size() == 4) {
-        lock_guard<mutex> g(mtx);
-        string key = parts[1] + " " + parts[2];
-        if(!is_member(parts[3], parts[1])) {
-            send_msg(fd, "ERR not_member");
-        } else {
+        shared_ptr<const string> meta, peer_list;
+        const char *err = nullptr;
+        {
+            RegistryLock g;
+            string key = parts[1] + " " + parts[2];
             auto it = files.find(key);
-            if(it == files.end()) {
-                send_msg(fd, "ERR no_file");
-            } else if(it->second.peers.empty()) {
-                send_msg(fd, "ERR no_peers_available");
-            } else {
-                auto& f = it->second;
-                string out = to_string(f.size) + " " + to_string(f.piece_sha.size()) + "\n" + f.sha + "\n";
-                for(size_t i = 0; i < f.piece_sha.size(); i++) out += (i ? "," : "") + f.piece_sha[i];
-                out += "\nPEERS\n";
-                for(auto& p : f.peers) out += p + "\n";
-                send_msg(fd, out);
+            if(!is_member(parts[3], parts[1])) err = "ERR not_member";
+            else if(it == files.end()) err = "ERR no_file";
+            else {
+                File& f = it->second;
+                if(f.reply_cached()) reply_cache_hits++;
+                meta = f.meta();
+                peer_list = swarm_peer_list(f, parts[3]);
+                if(peer_list->empty()) err = "ERR no_peers_available";
             }
         }
+        // the cached halves are immutable, so the reply goes out after unlocking
+        if(err) respond(fd, err);
+        else respond_parts(fd, *meta, *peer_list);
+    }
+    else if(cmd == "GET_VERSION" && parts.size() == 4) {
+        // the previous version's piece list, for a delta download
+        string reply;
+        RegistryLock g;
+        auto it = files.find(parts[1] + " " + parts[2]);
+        if(!is_member(parts[3], parts[1])) reply = "ERR not_member";
+        else if(it == files.end()) reply = "ERR no_file";
+        else if(it->second.prev_sha.empty()) reply = "ERR no_previous";
+        else {
+            const File& f = it->second;
+            size_t n = f.prev_digests.size() / 20;
+            reply = to_string(f.version - 1) + " " + f.prev_sha + " " + to_string(n) + "\n";
+            reply.reserve(reply.size() + 41 * n);
+            for(size_t i = 0; i < n; i++) {
+                if(i) reply += ',';
+                reply += raw_to_hex((const uint8_t*)f.prev_digests.data() + 20 * i, 20);
+            }
+        }
+        respond(fd, reply);
     }
     else if(cmd == "STOP_SHARE" && parts.size() == 4) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         string key = parts[1] + " " + parts[2];
         auto it = files.find(key);
         if(it != files.end()) {
-            it->second.peers.erase(parts[3]);
-            if(it->second.peers.empty()) files.erase(it);
+            it->second.remove_peer(parts[3]);
+            if(it->second.peers.empty()) erase_file(it);
         }
         save(); // Save immediately
-        send_msg(fd, "OK");
+        respond(fd, "OK");
         broadcast_sync("STOP_SHARE " + parts[1] + " " + parts[2] + " " + parts[3]);
     }
     else if(cmd == "ADD_PEER" && parts.size() == 4) {
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         string key = parts[1] + " " + parts[2];
         auto it = files.find(key);
-        if(it != files.end()) it->second.peers.insert(parts[3]);
+        if(it != files.end()) it->second.add_peer(parts[3]);
+        renew_lease(parts[3], lease_ttl_ms, false);
         save(); // Save immediately
-        send_msg(fd, "OK");
+        respond(fd, "OK");
         broadcast_sync("ADD_PEER " + parts[1] + " " + parts[2] + " " + parts[3]);
     }
     else if(cmd.substr(0, 11) == "UPLOAD_META") {
         string full = cmd;
         for(size_t i = 1; i < parts.size(); i++) full += " " + parts[i];
 
-        istringstream iss(full.substr(12));
+        istringstream iss(full.size() > 12 ? full.substr(12) : "");
         File file;
-        string peer, user, np_str;
-        iss >> file.group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user;
-        int np = stoi(np_str);
+        string group, peer, user, np_str;
+        size_t np = 0;
+        bool parsed = iss >> group >> file.filename >> file.size >> np_str >> file.sha >> peer >> user &&
+                      parse_count(np_str, np);
 
         string hash;
-        while(iss >> hash && (int)file.piece_sha.size() < np) {
-            if(hash.length() == 40) {
-                file.piece_sha.push_back(hash);
-            }
-        }
+        while(parsed && iss >> hash && file.npieces() < np) file.add_digest_hex(hash);
 
-        lock_guard<mutex> g(mtx);
-        if(!is_member(user, file.group)) {
-            send_msg(fd, "ERR not_member");
-        } else if((int)file.piece_sha.size() != np) {
-            send_msg(fd, "ERR piece_count_mismatch");
+        RegistryLock g;
+        if(!parsed) {
+            respond(fd, "ERR bad_request");
+        } else if(!is_member(user, group)) {
+            respond(fd, "ERR not_member");
+        } else if(file.npieces() != np || !piece_count_ok(file.size, np)) {
+            respond(fd, "ERR piece_count_mismatch");
+        } else if(np == 0 && (file.size == 0 || !is_digest_hex(file.sha))) {
+            respond(fd, "ERR bad_merkle_root");
         } else {
-            file.owner = user;
-            file.peers.insert(peer);
-            files[file.group + " " + file.filename] = file;
+            file.group = group_names.id(group);
+            file.owner = user_id(user);
+            file.add_peer(peer);
+            renew_lease(peer, lease_ttl_ms, false);
+            put_file(move(file));
             save(); // Save immediately
-            send_msg(fd, "OK");
+            respond(fd, "OK");
             // Send with UPLOAD_META prefix for sync handling
             broadcast_sync("UPLOAD_META " + full.substr(12));
         }
     }
+    else if(cmd == "UPLOAD_MANIFEST") {
+        // a whole tree in one transaction: one save() and one replication op
+        string group, peer, user;
+        vector<File> batch;
+        RegistryLock g; // parsing interns names
+        bool ok = parse_manifest(parts, 1, group, peer, user, batch);
+        if(!ok) {
+            respond(fd, "ERR bad_manifest");
+        } else if(!is_member(user, group)) {
+            respond(fd, "ERR not_member");
+        } else {
+            size_t n = batch.size();
+            renew_lease(peer, lease_ttl_ms, false);
+            for(auto& f : batch) put_file(move(f));
+            save();
+            respond(fd, "OK " + to_string(n));
+            string full = "UPLOAD_MANIFEST";
+            for(size_t i = 1; i < parts.size(); i++) full += " " + parts[i];
+            broadcast_sync(full);
+        }
+    }
+    else if(cmd == "GET_DIR" && parts.size() == 4) {
+        // every file under <dir>/, each as "FILE <name>", its GET_FILE_PEERS reply and a blank line
+        struct Entry { string name; shared_ptr<const string> meta, peers; };
+        vector<Entry> found;
+        string prefix = parts[2] + "/";
+        const char *err = nullptr;
+        {
+            RegistryLock g;
+            if(!is_member(parts[3], parts[1])) {
+                err = "ERR not_member";
+            } else {
+                uint32_t gid = group_names.find(parts[1]);
+                for(auto& kv : files) {
+                    File& f = kv.second;
+                    if(f.group != gid || f.filename.compare(0, prefix.size(), prefix) != 0) continue;
+                    found.push_back(Entry{f.filename, f.meta(), swarm_peer_list(f, parts[3])});
+                }
+                if(found.empty()) err = "ERR no_file";
+            }
+        }
+        if(err) {
+            respond(fd, err);
+        } else {
+            sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.name < b.name; });
+            string out = to_string(found.size()) + "\n";
+            for(auto& e : found) out += "FILE " + e.name + "\n" + *e.meta + *e.peers + "\n";
+            respond(fd, out);
+        }
+    }
+    else if(cmd == "ADD_PEERS" && parts.size() >= 4) {
+        // ADD_PEERS <group> <peer> <name>...: a finished directory download
+        RegistryLock g;
+        for(size_t i = 3; i < parts.size(); i++) {
+            auto it = files.find(parts[1] + " " + parts[i]);
+            if(it != files.end()) it->second.add_peer(parts[2]);
+        }
+        renew_lease(parts[2], lease_ttl_ms, false);
+        save();
+        respond(fd, "OK");
+        string full = "ADD_PEERS";
+        for(size_t i = 1; i < parts.size(); i++) full += " " + parts[i];
+        broadcast_sync(full);
+    }
+    else if(cmd == "ANNOUNCE" && parts.size() >= 2 && parts.size() % 3 == 2) {
+        // ANNOUNCE <peer> (<group> <name> <sha>)...: a restarted client resuming its shares
+        RegistryLock g;
+        size_t added = 0;
+        for(size_t i = 2; i < parts.size(); i += 3) added += announce_share(parts[i], parts[i + 1], parts[i + 2], parts[1]);
+        renew_lease(parts[1], lease_ttl_ms, false);
+        if(added) save();
+        respond(fd, "OK " + to_string(added));
+        string full = "ANNOUNCE";
+        for(size_t i = 1; i < parts.size(); i++) full += " " + parts[i];
+        broadcast_sync(full);
+    }
+    else if(cmd == "HEARTBEAT" && parts.size() == 2) {
+        // an evicted peer is in no swarm any more; it has to ANNOUNCE its shares again
+        bool known = renew_lease(parts[1], lease_ttl_ms, true);
+        respond(fd, (known ? "OK " : "EVICTED ") + to_string(lease_ttl_ms / 1000));
+    }
+    else if(cmd == "SYNC" && parts.size() >= 3 && parts[1] == "HEARTBEATS") {
+        // SYNC HEARTBEATS <ttl_ms> <peer>...: lease renewals only, no registry change and no save()
+        uint64_t ttl = strtoull(parts[2].c_str(), nullptr, 10);
+        for(size_t i = 3; i < parts.size(); i++) renew_lease(parts[i], ttl, false);
+        respond(fd, "OK");
+    }
     else if(cmd == "SYNC" && parts.size() >= 2) {
         string sync_data;
         for(size_t i = 1; i < parts.size(); i++) {
@@ -565,32 +1424,78 @@ void handle_command(const vector<string>& parts, int fd) {
         }
 
         if(!sync_data.empty()) {
-            lock_guard<mutex> g(mtx);
+            RegistryLock g;
             handle_sync(sync_data);
         }
-        send_msg(fd, "OK");
+        respond(fd, "OK");
+    }
+    else if(cmd == "STATS") {
+        respond(fd, metrics_text());
+    }
+    else if(cmd == "PING") {
+        respond(fd, "PONG");
     }
     else {
-        send_msg(fd, "ERR unknown_cmd");
+        respond(fd, "ERR unknown_cmd");
+    }
+}
+
+// Requests are capped at MAX_MSG_BYTES, except a manifest (a client's
+// UPLOAD_MANIFEST or a replica's SYNC of one), which may run to
+// MAX_BULK_MSG_BYTES. Its command is checked before the rest is read.
+static bool recv_request(int fd, string& msg) {
+    const uint32_t HEAD = 64;
+    uint32_t n;
+    if(recv_all(fd, &n, 4) != 4) return false;
+    n = ntohl(n);
+    if(n <= MAX_MSG_BYTES) {
+        msg.resize(n);
+        return n == 0 || recv_all(fd, &msg[0], n) == (ssize_t)n;
     }
+    if(n > MAX_BULK_MSG_BYTES) return false;
+    msg.assign(HEAD, '\0');
+    if(recv_all(fd, &msg[0], HEAD) != (ssize_t)HEAD) return false;
+    auto head = split_ws(msg);
+    size_t i = !head.empty() && head[0][0] == '#'; // reply tag
+    if(i < head.size() && head[i] == "SYNC") i++;
+    if(i + 1 >= head.size() || head[i] != "UPLOAD_MANIFEST") return false;
+    msg.resize(n);
+    return recv_all(fd, &msg[HEAD], n - HEAD) == (ssize_t)(n - HEAD);
 }
 
 void serve_client(int fd) {
     string msg;
-    while(recv_msg(fd, msg) && !msg.empty()) {
+    while(recv_request(fd, msg) && !msg.empty()) {
         auto parts = split_ws(msg);
-        if(!parts.empty()) handle_command(parts, fd);
+        reply_tag.clear();
+        if(!parts.empty() && parts[0][0] == '#') {
+            reply_tag = parts[0];
+            parts.erase(parts.begin());
+        }
+        if(parts.empty()) continue;
+
+        auto t0 = chrono::steady_clock::now();
+        reply_err = false;
+        handle_command(parts, fd);
+        CmdStats& st = cmd_stats[cmd_slot(parts[0])];
+        st.latency.record_ns(since_ns(t0));
+        if(reply_err) st.errors++;
     }
     close(fd);
 }
 
 int main(int argc, char **argv) {
     if(argc < 3) {
-        cerr << "Usage: tracker tracker_info.txt <idx>\n";
+        cerr << "Usage: tracker tracker_info.txt <idx> [-q] [--eager-pieces] [--lease-ttl SECS]\n";
         return 1;
     }
 
     self_idx = atoi(argv[2]);
+    for(int i = 3; i < argc; i++) {
+        if(string(argv[i]) == "-q") log_verbose = false;
+        else if(string(argv[i]) == "--eager-pieces") eager_pieces = true;
+        else if(string(argv[i]) == "--lease-ttl" && i + 1 < argc) lease_ttl_ms = 1000 * strtoull(argv[++i], nullptr, 10);
+    }
     load();
 
     ifstream ifs(argv[1]);
@@ -600,6 +1505,9 @@ int main(int argc, char **argv) {
         cerr << "bad idx\n";
         return 1;
     }
+    start_sync_workers();
+    grant_startup_leases();
+    thread(lease_sweeper).detach();
 
     string my = trackers[self_idx];
     size_t p = my.find(':');
@@ -622,15 +1530,22 @@ int main(int argc, char **argv) {
         string cmd;
         while(getline(cin, cmd) && cmd != "quit") {
             if(cmd == "save") {
-                lock_guard<mutex> g(mtx);
+                RegistryLock g;
                 save();
+            } else if(cmd == "export") {
+                RegistryLock g;
+                export_text();
             } else if(cmd == "status") {
-                lock_guard<mutex> g(mtx);
-                cout << "Users: " << users.size() << ", Groups: " << groups.size() 
+                RegistryLock g;
+                cout << "Users: " << nusers << ", Groups: " << groups.size() 
                      << ", Files: " << files.size() << endl;
+            } else if(cmd == "stats") {
+                cout << metrics_text() << flush;
+            } else if(cmd == "log on" || cmd == "log off") {
+                log_verbose = cmd == "log on";
             }
         }
-        lock_guard<mutex> g(mtx);
+        RegistryLock g;
         save();
         exit(0);
     }).detach();